@@ -0,0 +1,61 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define BLOCK_SIZE (64 * 1024)
+
+struct arenablock {
+    struct arenablock *next;
+    // followed by the allocations
+};
+
+void arena_init(struct arena *arena)
+{
+    arena->blocks = NULL;
+    arena->next = NULL;
+    arena->left = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size, size_t align)
+{
+    size_t pad = -(uintptr_t)arena->next & (align - 1);
+
+    if (arena->next == NULL || pad + size > arena->left) {
+        // allocations larger than a block get a block of their own
+        size_t len = sizeof(struct arenablock) + align - 1
+                     + (size > BLOCK_SIZE / 4 ? size : BLOCK_SIZE);
+        struct arenablock *block = malloc(len);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->next = (char*)(block + 1);
+        arena->left = len - sizeof *block;
+        pad = -(uintptr_t)arena->next & (align - 1);
+    }
+
+    void *p = arena->next + pad;
+    arena->next += pad + size;
+    arena->left -= pad + size;
+    return p;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+    char *p = arena_alloc(arena, len + 1, 1);
+    memcpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+
+void arena_free(struct arena *arena)
+{
+    while (arena->blocks) {
+        struct arenablock *block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena_init(arena);
+}
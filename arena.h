@@ -0,0 +1,39 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * Allocation of many small objects that live as long as their arena, packed
+ * in large blocks without the overhead malloc adds to every allocation. An
+ * arena is not thread safe; each thread allocates from an arena of its own.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arenablock;
+
+struct arena {
+    struct arenablock *blocks;
+    char *next;                 // free space in the current block
+    size_t left;
+};
+
+void arena_init(struct arena *arena);
+
+/**
+ * @return size bytes aligned to align, a power of two, valid until the arena
+ * is freed
+ */
+void *arena_alloc(struct arena *arena, size_t size, size_t align);
+
+/**
+ * @return a copy of the first len chars of str, terminated by '\0'
+ */
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+
+/**
+ * free all the memory allocated from arena
+ */
+void arena_free(struct arena *arena);
+
+#endif
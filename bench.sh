@@ -0,0 +1,92 @@
+#!/bin/bash
+
+# Benchmark finddupes on synthetic trees, with cold and warm page cache.
+#
+# Environment:
+#   FD        finddupes binary to measure (./finddupes), so that builds can be
+#             compared on the same trees
+#   BENCHDIR  where the trees are made and kept between runs
+#             (/tmp/finddupes-bench)
+#   TREES     lines of name:fdbench tree options, see fdbench.c
+#   OPTS      lines of finddupes options to measure on every tree
+#   RUNS      runs of each measure; the one with the least wall time is kept
+#
+# The report, also written to bench_output.txt, has one line per tree, options
+# and cache state with the wall and CPU times in seconds, the bytes read
+# through system calls and from storage in MiB, the read and write system
+# calls, and the peak resident set size in MiB. Reads through io_uring are not
+# counted as system calls nor in the bytes read through them. A cold cache
+# drops the pages of the tree, and directory entries and inodes as well when
+# run as root.
+
+FD=${FD-./finddupes}
+BENCH=./fdbench
+BENCHDIR=${BENCHDIR-/tmp/finddupes-bench}
+RUNS=${RUNS-3}
+TREES=${TREES-"small:-n 20000 -s 1K:64K -k 64 -d 0.3 -l 0.05 -D 3 -F 8
+headers:-n 300 -s 256K:4M -k 6 -d 0.2 -l 0.02 -p 192K -D 1 -F 4
+deep:-n 20000 -s 512:4K -k 16 -d 0.1 -l 0 -D 6 -F 4"}
+OPTS=${OPTS-"-j1
+-j4
+-j4 --io=uring
+-j4 --hash=blake3
+-j4 --compare=bytes"}
+
+# make the tree name with the fdbench options args unless it is there already
+maketree()
+{
+    local name=$1 args=$2
+
+    if [ "$(cat "$BENCHDIR/$name.args" 2>/dev/null)" = "$args" ]; then
+        return 0
+    fi
+    echo "making tree $name: $args" >&2
+    rm -rf "$BENCHDIR/$name" "$BENCHDIR/$name.args"
+    $BENCH tree $args "$BENCHDIR/$name" || exit 1
+    echo "$args" > "$BENCHDIR/$name.args"
+}
+
+# print the best of RUNS measures of finddupes with opts on tree name
+measure()
+{
+    local name=$1 opts=$2 cache=$3 best= line i
+
+    for ((i = 0; i < RUNS; ++i)); do
+        if [ $cache = cold ]; then
+            $BENCH evict "$BENCHDIR/$name"
+        else
+            $FD -rq $opts "$BENCHDIR/$name" > /dev/null 2>&1
+        fi
+        line=$($BENCH run $FD -rq $opts "$BENCHDIR/$name") || exit 1
+        if [ -z "$best" ] || awk -v a="$line" -v b="$best" \
+                'BEGIN { split(a, x, " "); split(b, y, " "); exit !(x[1] < y[1]) }'
+        then
+            best=$line
+        fi
+    done
+    echo "$best"
+}
+
+mkdir -p "$BENCHDIR" || exit 1
+echo "$TREES" | while IFS=: read name args; do
+    maketree "$name" "$args"
+done
+
+{
+    printf "%-10s %-24s %-5s %8s %7s %7s %9s %9s %8s %7s %8s\n" \
+        tree options cache wall user sys "rMiB" "diskMiB" syscr syscw "rssMiB"
+    echo "$TREES" | while IFS=: read name args; do
+        echo "$OPTS" | while read opts; do
+            for cache in cold warm; do
+                set -- $(measure "$name" "$opts" $cache)
+                if [ "${9}" != 0 ]; then
+                    echo "$FD failed on $name with $opts: status ${9}" >&2
+                fi
+                printf "%-10s %-24s %-5s %8.3f %7.3f %7.3f %9.1f %9.1f %8d %7d %8.1f\n" \
+                    "$name" "$opts" $cache $1 $2 $3 \
+                    $(awk "BEGIN { print $4 / 1048576, $5 / 1048576 }") \
+                    $6 $7 $(awk "BEGIN { print $8 / 1024 }")
+            done
+        done
+    done
+} | tee bench_output.txt
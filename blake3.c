@@ -0,0 +1,387 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+
+#include <string.h>
+
+#include "blake3.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+enum {
+    CHUNK_START = 1 << 0,
+    CHUNK_END   = 1 << 1,
+    PARENT      = 1 << 2,
+    ROOT        = 1 << 3,
+};
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+// the message word permutation applied before each of the 7 rounds
+static const uint8_t SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+        | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(uint8_t *p, uint32_t w)
+{
+    p[0] = w;
+    p[1] = w >> 8;
+    p[2] = w >> 16;
+    p[3] = w >> 24;
+}
+
+static inline uint32_t rotr32(uint32_t w, int c)
+{
+    return w >> c | w << (32 - c);
+}
+
+static inline void g(uint32_t *v, int a, int b, int c, int d,
+    uint32_t x, uint32_t y)
+{
+    v[a] += v[b] + x;
+    v[d] = rotr32(v[d] ^ v[a], 16);
+    v[c] += v[d];
+    v[b] = rotr32(v[b] ^ v[c], 12);
+    v[a] += v[b] + y;
+    v[d] = rotr32(v[d] ^ v[a], 8);
+    v[c] += v[d];
+    v[b] = rotr32(v[b] ^ v[c], 7);
+}
+
+/**
+ * run the compression function on block and leave the 16 state words in out
+ */
+static void compress(const uint32_t cv[8], const uint8_t block[64],
+    uint8_t block_len, uint64_t counter, uint8_t flags, uint32_t out[16])
+{
+    uint32_t m[16];
+    uint32_t v[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags,
+    };
+
+    for (int i = 0; i < 16; ++i)
+        m[i] = load32(block + 4 * i);
+
+#pragma GCC unroll 7
+    for (int r = 0; r < 7; ++r) {
+        const uint8_t *s = SCHEDULE[r];
+        g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+/**
+ * a node of the tree whose chaining value or root output is still to be
+ * computed
+ */
+struct output {
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint64_t counter;
+    uint8_t flags;
+};
+
+static void outputcv(const struct output *o, uint32_t cv[8])
+{
+    uint32_t out[16];
+    compress(o->cv, o->block, o->block_len, o->counter, o->flags, out);
+    memcpy(cv, out, 8 * sizeof *cv);
+}
+
+static void parentoutput(const uint32_t left[8], const uint32_t right[8],
+    struct output *o)
+{
+    memcpy(o->cv, IV, sizeof o->cv);
+    for (int i = 0; i < 8; ++i) {
+        store32(o->block + 4 * i, left[i]);
+        store32(o->block + 32 + 4 * i, right[i]);
+    }
+    o->block_len = BLAKE3_BLOCK_LEN;
+    o->counter = 0;
+    o->flags = PARENT;
+}
+
+static void chunkinit(struct blake3_chunk *c, uint64_t counter)
+{
+    memcpy(c->cv, IV, sizeof c->cv);
+    c->counter = counter;
+    c->block_len = 0;
+    c->blocks_compressed = 0;
+}
+
+static size_t chunklen(const struct blake3_chunk *c)
+{
+    return BLAKE3_BLOCK_LEN * (size_t)c->blocks_compressed + c->block_len;
+}
+
+static uint8_t chunkstartflag(const struct blake3_chunk *c)
+{
+    return c->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunkupdate(struct blake3_chunk *c, const uint8_t *input,
+    size_t len)
+{
+    while (len > 0) {
+        if (c->block_len == BLAKE3_BLOCK_LEN) {
+            uint32_t out[16];
+            compress(c->cv, c->block, BLAKE3_BLOCK_LEN, c->counter,
+                     chunkstartflag(c), out);
+            memcpy(c->cv, out, sizeof c->cv);
+            ++c->blocks_compressed;
+            c->block_len = 0;
+        }
+        size_t take = BLAKE3_BLOCK_LEN - c->block_len;
+        if (take > len)
+            take = len;
+        memcpy(c->block + c->block_len, input, take);
+        c->block_len += take;
+        input += take;
+        len -= take;
+    }
+}
+
+static void chunkoutput(const struct blake3_chunk *c, struct output *o)
+{
+    memcpy(o->cv, c->cv, sizeof o->cv);
+    memcpy(o->block, c->block, c->block_len);
+    memset(o->block + c->block_len, 0, BLAKE3_BLOCK_LEN - c->block_len);
+    o->block_len = c->block_len;
+    o->counter = c->counter;
+    o->flags = chunkstartflag(c) | CHUNK_END;
+}
+
+/**
+ * push the chaining value of a completed chunk, first merging it with the
+ * subtrees it completes; total is the number of chunks so far
+ */
+static void addchunkcv(struct blake3 *self, const uint32_t chunkcv[8],
+    uint64_t total)
+{
+    uint32_t cv[8];
+    struct output o;
+
+    memcpy(cv, chunkcv, sizeof cv);
+    while ((total & 1) == 0) {
+        parentoutput(self->cv_stack[--self->cv_stack_len], cv, &o);
+        outputcv(&o, cv);
+        total >>= 1;
+    }
+    memcpy(self->cv_stack[self->cv_stack_len++], cv, sizeof cv);
+}
+
+#ifdef HAVE_AVX2
+
+#define ROTR256(x, c) \
+    _mm256_or_si256(_mm256_srli_epi32((x), (c)), _mm256_slli_epi32((x), 32 - (c)))
+
+// rotations by whole bytes are a single shuffle
+#define ROTR256_16(x) _mm256_shuffle_epi8((x), _mm256_set_epi8( \
+    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, \
+    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2))
+#define ROTR256_8(x) _mm256_shuffle_epi8((x), _mm256_set_epi8( \
+    12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1, \
+    12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1))
+
+#define G256(a, b, c, d, x, y) do {             \
+        a = _mm256_add_epi32(a, _mm256_add_epi32(b, x)); \
+        d = ROTR256_16(_mm256_xor_si256(d, a)); \
+        c = _mm256_add_epi32(c, d);             \
+        b = ROTR256(_mm256_xor_si256(b, c), 12); \
+        a = _mm256_add_epi32(a, _mm256_add_epi32(b, y)); \
+        d = ROTR256_8(_mm256_xor_si256(d, a)); \
+        c = _mm256_add_epi32(c, d);             \
+        b = ROTR256(_mm256_xor_si256(b, c), 7); \
+    } while (0)
+
+/**
+ * transpose the 8x8 matrix of 32-bit words in rows
+ */
+__attribute__((target("avx2")))
+static inline void transpose8(__m256i rows[8])
+{
+    __m256i t[8], u[8];
+
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; ++i) {
+        rows[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        rows[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+/**
+ * compute the chaining values of the 8 consecutive whole chunks at input,
+ * the first of them being chunk number counter, one chunk per vector lane
+ */
+__attribute__((target("avx2")))
+static void hash8(const uint8_t *input, uint64_t counter, uint32_t cvs[8][8])
+{
+    __m256i h[8], m[16], v[16];
+    uint32_t lo[8], hi[8];
+
+    for (int i = 0; i < 8; ++i) {
+        h[i] = _mm256_set1_epi32(IV[i]);
+        lo[i] = (uint32_t)(counter + i);
+        hi[i] = (uint32_t)((counter + i) >> 32);
+    }
+    const __m256i counterlo = _mm256_loadu_si256((const __m256i*)lo);
+    const __m256i counterhi = _mm256_loadu_si256((const __m256i*)hi);
+
+    for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; ++b) {
+        const uint8_t *block = input + b * BLAKE3_BLOCK_LEN;
+        uint8_t flags = (b == 0 ? CHUNK_START : 0)
+            | (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0);
+
+        // gather word w of every lane's block into m[w]
+        for (int lane = 0; lane < 8; ++lane) {
+            const uint8_t *p = block + lane * BLAKE3_CHUNK_LEN;
+            m[lane] = _mm256_loadu_si256((const __m256i*)p);
+            m[lane + 8] = _mm256_loadu_si256((const __m256i*)(p + 32));
+        }
+        transpose8(m);
+        transpose8(m + 8);
+
+        for (int i = 0; i < 8; ++i)
+            v[i] = h[i];
+        for (int i = 0; i < 4; ++i)
+            v[8 + i] = _mm256_set1_epi32(IV[i]);
+        v[12] = counterlo;
+        v[13] = counterhi;
+        v[14] = _mm256_set1_epi32(BLAKE3_BLOCK_LEN);
+        v[15] = _mm256_set1_epi32(flags);
+
+#pragma GCC unroll 7
+        for (int r = 0; r < 7; ++r) {
+            const uint8_t *s = SCHEDULE[r];
+            G256(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+            G256(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+            G256(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+            G256(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+            G256(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+            G256(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+            G256(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+            G256(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+        }
+
+        for (int i = 0; i < 8; ++i)
+            h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+
+    transpose8(h);
+    for (int lane = 0; lane < 8; ++lane)
+        _mm256_storeu_si256((__m256i*)cvs[lane], h[lane]);
+}
+
+static int haveavx2(void)
+{
+    static int cached = -1;
+    if (cached == -1)
+        cached = __builtin_cpu_supports("avx2");
+    return cached;
+}
+
+#endif
+
+void blake3_init(struct blake3 *self)
+{
+    chunkinit(&self->chunk, 0);
+    self->cv_stack_len = 0;
+}
+
+void blake3_update(struct blake3 *self, const void *data, size_t len)
+{
+    const uint8_t *input = data;
+
+    while (len > 0) {
+        // a full chunk is finished only once more input shows it isn't
+        // the root
+        if (chunklen(&self->chunk) == BLAKE3_CHUNK_LEN) {
+            struct output o;
+            uint32_t cv[8];
+            uint64_t total = self->chunk.counter + 1;
+            chunkoutput(&self->chunk, &o);
+            outputcv(&o, cv);
+            addchunkcv(self, cv, total);
+            chunkinit(&self->chunk, total);
+        }
+
+#ifdef HAVE_AVX2
+        while (chunklen(&self->chunk) == 0 && len > 8 * BLAKE3_CHUNK_LEN
+                && haveavx2()) {
+            uint32_t cvs[8][8];
+            uint64_t counter = self->chunk.counter;
+            hash8(input, counter, cvs);
+            for (int i = 0; i < 8; ++i)
+                addchunkcv(self, cvs[i], counter + i + 1);
+            chunkinit(&self->chunk, counter + 8);
+            input += 8 * BLAKE3_CHUNK_LEN;
+            len -= 8 * BLAKE3_CHUNK_LEN;
+        }
+#endif
+
+        size_t take = BLAKE3_CHUNK_LEN - chunklen(&self->chunk);
+        if (take > len)
+            take = len;
+        chunkupdate(&self->chunk, input, take);
+        input += take;
+        len -= take;
+    }
+}
+
+void blake3_final(const struct blake3 *self, uint8_t *out, size_t len)
+{
+    struct output o;
+    uint32_t cv[8];
+    uint32_t words[16];
+
+    chunkoutput(&self->chunk, &o);
+    for (int i = self->cv_stack_len; i > 0; --i) {
+        outputcv(&o, cv);
+        parentoutput(self->cv_stack[i - 1], cv, &o);
+    }
+
+    compress(o.cv, o.block, o.block_len, 0, o.flags | ROOT, words);
+    if (len > BLAKE3_OUT_LEN)
+        len = BLAKE3_OUT_LEN;
+    for (size_t i = 0; i < len; ++i)
+        out[i] = words[i / 4] >> 8 * (i % 4);
+}
@@ -0,0 +1,40 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * BLAKE3 hashing without keys or key derivation. On x86 CPUs with AVX2 eight
+ * chunks of long inputs are compressed at once.
+ */
+
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+struct blake3_chunk {
+    uint32_t cv[8];
+    uint64_t counter;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+};
+
+struct blake3 {
+    struct blake3_chunk chunk;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+    uint8_t cv_stack_len;
+};
+
+void blake3_init(struct blake3 *self);
+void blake3_update(struct blake3 *self, const void *input, size_t len);
+
+/**
+ * write the first len bytes, at most BLAKE3_OUT_LEN, of the hash to out
+ */
+void blake3_final(const struct blake3 *self, uint8_t *out, size_t len);
+
+#endif
@@ -0,0 +1,285 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "klib/khash.h"
+
+/*
+ * A cache file is a header followed by records, all in host byte order:
+ *
+ *   header: magic[8] engine[16]
+ *   record: dev ino size mtime ctime (8 bytes each) nsigs (1 byte)
+ *           nsigs * (len (8 bytes) digest[HASH_LEN])
+ */
+static const char MAGIC[8] = "fdcache2";
+#define ENGINE_LEN 16
+#define KEY_LEN (5 * 8)
+#define SIG_LEN (8 + HASH_LEN)
+#define MAX_SIGS 255
+
+// files whose times are this close to the start of the run are not cached
+#define RECENT_NS 2000000000LL
+
+struct cachedsig {
+    int64_t len;
+    unsigned char digest[HASH_LEN];
+};
+
+struct cacheentry {
+    struct cachedsig *sigs;
+    unsigned char nsigs;
+    unsigned char keep;         // write back on save
+};
+
+static inline khint_t cachehash(struct cachekey key)
+{
+    return kh_int64_hash_func(key.ino ^ key.dev << 32 ^ key.mtime);
+}
+
+static inline int cacheequal(struct cachekey a, struct cachekey b)
+{
+    return a.dev == b.dev && a.ino == b.ino && a.size == b.size
+        && a.mtime == b.mtime && a.ctime == b.ctime;
+}
+
+KHASH_INIT(cache, struct cachekey, struct cacheentry, 1, cachehash, cacheequal)
+
+struct sigcache {
+    khash_t(cache) *entries;
+    char engine[ENGINE_LEN];
+    int64_t start;              // time the cache was opened, in nanoseconds
+};
+
+/**
+ * read the next record of file into key and entry
+ *
+ * @return 1 on success, 0 at end of file, -1 if the record is truncated
+ */
+static int loadrecord(FILE *file, struct cachekey *key,
+    struct cacheentry *entry)
+{
+    unsigned char buf[KEY_LEN + 1];
+    size_t n = fread(buf, 1, sizeof buf, file);
+
+    if (n != sizeof buf)
+        return n == 0 && !ferror(file) ? 0 : -1;
+
+    memcpy(&key->dev, buf, 8);
+    memcpy(&key->ino, buf + 8, 8);
+    memcpy(&key->size, buf + 16, 8);
+    memcpy(&key->mtime, buf + 24, 8);
+    memcpy(&key->ctime, buf + 32, 8);
+    entry->nsigs = buf[KEY_LEN];
+    entry->keep = 0;
+    entry->sigs = malloc(entry->nsigs * sizeof *entry->sigs);
+
+    for (int i = 0; i < entry->nsigs; ++i) {
+        unsigned char sig[SIG_LEN];
+        if (fread(sig, 1, sizeof sig, file) != sizeof sig) {
+            free(entry->sigs);
+            return -1;
+        }
+        memcpy(&entry->sigs[i].len, sig, 8);
+        memcpy(entry->sigs[i].digest, sig + 8, HASH_LEN);
+    }
+    return 1;
+}
+
+static void storerecord(FILE *file, const struct cachekey *key,
+    const struct cacheentry *entry)
+{
+    unsigned char buf[KEY_LEN + 1];
+
+    memcpy(buf, &key->dev, 8);
+    memcpy(buf + 8, &key->ino, 8);
+    memcpy(buf + 16, &key->size, 8);
+    memcpy(buf + 24, &key->mtime, 8);
+    memcpy(buf + 32, &key->ctime, 8);
+    buf[KEY_LEN] = entry->nsigs;
+    fwrite(buf, 1, sizeof buf, file);
+
+    for (int i = 0; i < entry->nsigs; ++i) {
+        unsigned char sig[SIG_LEN];
+        memcpy(sig, &entry->sigs[i].len, 8);
+        memcpy(sig + 8, entry->sigs[i].digest, HASH_LEN);
+        fwrite(sig, 1, sizeof sig, file);
+    }
+}
+
+static void clearentries(khash_t(cache) *entries)
+{
+    khint_t k;
+    for (k = kh_begin(entries); k != kh_end(entries); ++k)
+        if (kh_exist(entries, k))
+            free(kh_value(entries, k).sigs);
+    kh_clear(cache, entries);
+}
+
+struct sigcache *cache_open(const char *path, const char *engine, int *err)
+{
+    struct sigcache *cache = malloc(sizeof *cache);
+    struct timespec now;
+    char header[sizeof MAGIC + ENGINE_LEN];
+    FILE *file;
+    int ret;
+
+    cache->entries = kh_init(cache);
+    memset(cache->engine, 0, sizeof cache->engine);
+    strncpy(cache->engine, engine, sizeof cache->engine - 1);
+    clock_gettime(CLOCK_REALTIME, &now);
+    cache->start = now.tv_sec * 1000000000LL + now.tv_nsec;
+    *err = 0;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            *err = errno;
+        return cache;
+    }
+
+    size_t n = fread(header, 1, sizeof header, file);
+    if (n == 0 && !ferror(file)) { // empty file
+        fclose(file);
+        return cache;
+    }
+    if (n != sizeof header || memcmp(header, MAGIC, sizeof MAGIC) != 0) {
+        *err = ferror(file) ? EIO : EINVAL;
+        fclose(file);
+        return cache;
+    }
+    if (memcmp(header + sizeof MAGIC, cache->engine, ENGINE_LEN) != 0) {
+        // signatures of another hash engine are of no use
+        fclose(file);
+        return cache;
+    }
+
+    for (;;) {
+        struct cachekey key;
+        struct cacheentry entry;
+
+        ret = loadrecord(file, &key, &entry);
+        if (ret <= 0)
+            break;
+        khiter_t k = kh_put(cache, cache->entries, key, &ret);
+        if (ret <= 0) { // duplicated key, or kh_put failed
+            free(entry.sigs);
+            ret = -1;
+            break;
+        }
+        kh_value(cache->entries, k) = entry;
+    }
+    if (ret == -1) {
+        *err = ferror(file) ? EIO : EINVAL;
+        clearentries(cache->entries);
+    }
+
+    fclose(file);
+    return cache;
+}
+
+int cache_get(const struct sigcache *cache, const struct cachekey *key,
+    int64_t len, unsigned char digest[HASH_LEN])
+{
+    khiter_t k = kh_get(cache, cache->entries, *key);
+
+    if (k == kh_end(cache->entries))
+        return 0;
+
+    const struct cacheentry *entry = &kh_value(cache->entries, k);
+    for (int i = 0; i < entry->nsigs; ++i)
+        if (entry->sigs[i].len == len) {
+            memcpy(digest, entry->sigs[i].digest, HASH_LEN);
+            return 1;
+        }
+    return 0;
+}
+
+void cache_put(struct sigcache *cache, const struct cachekey *key,
+    int64_t len, const unsigned char digest[HASH_LEN])
+{
+    int ret;
+
+    if (key->mtime > cache->start - RECENT_NS
+            || key->ctime > cache->start - RECENT_NS)
+        return;
+
+    khiter_t k = kh_put(cache, cache->entries, *key, &ret);
+    if (ret == -1)
+        return;
+
+    struct cacheentry *entry = &kh_value(cache->entries, k);
+    if (ret != 0) {
+        entry->sigs = NULL;
+        entry->nsigs = 0;
+    }
+    entry->keep = 1;
+
+    int i;
+    for (i = 0; i < entry->nsigs; ++i)
+        if (entry->sigs[i].len == len)
+            break;
+    if (i == entry->nsigs) {
+        if (entry->nsigs == MAX_SIGS)
+            return;
+        entry->sigs = realloc(entry->sigs, ++entry->nsigs * sizeof *entry->sigs);
+        entry->sigs[i].len = len;
+    }
+    memcpy(entry->sigs[i].digest, digest, HASH_LEN);
+}
+
+int cache_save(struct sigcache *cache, const char *path)
+{
+    size_t len = strlen(path);
+    char *tmppath = malloc(len + sizeof ".tmp");
+    FILE *file;
+    khint_t k;
+
+    memcpy(tmppath, path, len);
+    memcpy(tmppath + len, ".tmp", sizeof ".tmp");
+
+    file = fopen(tmppath, "wb");
+    if (file == NULL) {
+        free(tmppath);
+        return -1;
+    }
+
+    fwrite(MAGIC, 1, sizeof MAGIC, file);
+    fwrite(cache->engine, 1, sizeof cache->engine, file);
+    for (k = kh_begin(cache->entries); k != kh_end(cache->entries); ++k)
+        if (kh_exist(cache->entries, k) && kh_value(cache->entries, k).keep)
+            storerecord(file, &kh_key(cache->entries, k),
+                        &kh_value(cache->entries, k));
+
+    // a cache that cannot be written in full must not replace the old one
+    if (fflush(file) == EOF || ferror(file) || fsync(fileno(file)) == -1) {
+        int err = errno ? errno : EIO;
+        fclose(file);
+        unlink(tmppath);
+        free(tmppath);
+        errno = err;
+        return -1;
+    }
+    if (fclose(file) == EOF || rename(tmppath, path) == -1) {
+        int err = errno;
+        unlink(tmppath);
+        free(tmppath);
+        errno = err;
+        return -1;
+    }
+
+    free(tmppath);
+    return 0;
+}
+
+void cache_free(struct sigcache *cache)
+{
+    clearentries(cache->entries);
+    kh_destroy(cache, cache->entries);
+    free(cache);
+}
@@ -0,0 +1,63 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * Persistent cache of file signatures. Files are identified by device, inode,
+ * size and modification and status change times, so any change to a file
+ * makes its old signatures unreachable. Each file may have signatures of
+ * several prefixes, told apart by the number of bytes hashed. Only the entries
+ * looked up or added during a run are written back, which drops the
+ * signatures of files that changed or went away.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "hash.h"
+
+struct cachekey {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;      // nanoseconds
+    int64_t ctime;      // nanoseconds
+};
+
+struct sigcache;
+
+/**
+ * load the cache at path, kept for signatures computed with engine; a
+ * missing file or one written for another engine gives an empty cache
+ *
+ * @return the cache, never NULL; *err is set to 0, or to an errno value if
+ * the file could not be read, in which case the cache is empty
+ */
+struct sigcache *cache_open(const char *path, const char *engine, int *err);
+
+/**
+ * look up the signature of the first len bytes of the file with key; safe to
+ * call from several threads as long as no one calls cache_put
+ *
+ * @return 1 and the signature in digest if found, 0 otherwise
+ */
+int cache_get(const struct sigcache *cache, const struct cachekey *key,
+    int64_t len, unsigned char digest[HASH_LEN]);
+
+/**
+ * store the signature of the first len bytes of the file with key and keep
+ * the entry for the next run. Files changed too recently are not stored, as
+ * a later change might not alter their times.
+ */
+void cache_put(struct sigcache *cache, const struct cachekey *key,
+    int64_t len, const unsigned char digest[HASH_LEN]);
+
+/**
+ * atomically replace the file at path with the entries kept for the next run
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int cache_save(struct sigcache *cache, const char *path);
+
+void cache_free(struct sigcache *cache);
+
+#endif
@@ -52,6 +52,10 @@ sortdupes()
 tearDown()
 {
     test -a $D/hardlink_two && rm $D/hardlink_two
+    test -h $D/recursed_b/loop && rm $D/recursed_b/loop
+    rm -f $D.cache
+    rm -rf $D.age $D.fds $D.json
+    test -n "$other" && rm -rf "$other"
 }
 
 test_symlink_file()
@@ -140,6 +144,16 @@ END
     assertEquals "$exp" "$res"
 }
 
+test_symlink_loop()
+{
+    ln -s ../recursed_b $D/recursed_b/loop
+
+    res=$($FD --symlinks --recursive $D/recursed_b)
+    assertEquals 0 $?
+    exp=
+    assertEquals "$exp" "$res"
+}
+
 test_empty()
 {
     res=$($FD $D/zero_a $D/zero_b)
@@ -254,6 +268,11 @@ testdir/big/big2_copy	testdir/big/big2
 END
 )
     assertEquals "$exp" "$res"
+
+    # separators are printed as they are, not as formats
+    res=$($FD -p '%s%n' -P '%d\n' $D/two $D/twice_one)
+    assertEquals 0 $?
+    assertEquals "testdir/two%s%ntestdir/twice_one%d" "$res"
 }
 
 test_separator_null()
@@ -269,6 +288,71 @@ END
     assertEquals "$exp" "$res"
 }
 
+test_filters()
+{
+    res=$($FD -r --min-size=5 --max-size=8K $D/ 2>/dev/null | sortdupes)
+    exp=$(cat<<'END'
+testdir/recursed_a/two_plus_one
+testdir/recursed_b/three
+
+testdir/recursed_b/seven
+testdir/seven
+
+testdir/with spaces a
+testdir/with spaces b
+END
+)
+    assertEquals "$exp" "$res"
+
+    res=$($FD -r --exclude-dir=recursed_b --exclude-dir='*/big' --include='t*' \
+          $D/ 2>/dev/null | sortdupes)
+    exp=$(cat<<'END'
+testdir/recursed_a/two
+testdir/twice_one
+testdir/two
+END
+)
+    assertEquals "$exp" "$res"
+
+    res=$($FD -r --max-depth=0 --exclude='z*' $D/ 2>/dev/null | sortdupes)
+    exp=$(cat<<'END'
+testdir/twice_one
+testdir/two
+
+testdir/with spaces a
+testdir/with spaces b
+END
+)
+    assertEquals "$exp" "$res"
+
+    mkdir -p $D.age
+    for f in a b c d; do echo age > $D.age/$f; done
+    touch -d '3 days ago' $D.age/a $D.age/b
+    res=$($FD --min-age=2 $D.age/a $D.age/b $D.age/c $D.age/d)
+    assertEquals "$(printf '%s\n' $D.age/a $D.age/b)" "$res"
+    res=$($FD --max-age=1h $D.age/a $D.age/b $D.age/c $D.age/d)
+    assertEquals "$(printf '%s\n' $D.age/c $D.age/d)" "$res"
+    res=$($FD -r --one-file-system $D.age)
+    assertEquals 4 "$(echo "$res" | grep -c .)"
+
+    # a directory on another file system, here the temporary one reached
+    # through a symlink, is left out
+    other=$(mktemp -d)
+    [ "$(stat -c %d $D)" = "$(stat -c %d $other)" ] && startSkipping
+    echo age > $other/e
+    ln -s $other $D.age/other
+    res=$($FD -rs $D.age)
+    assertEquals 5 "$(echo "$res" | grep -c .)"
+    res=$($FD -rs --one-file-system $D.age)
+    assertEquals 4 "$(echo "$res" | grep -c .)"
+    endSkipping
+
+    for opt in --min-size=x --max-depth=-1 --min-age=1y --max-age=h; do
+        $FD $opt $D/two 2>/dev/null
+        assertEquals "$opt" 1 $?
+    done
+}
+
 test_omitfirst()
 {
     res=$($FD -f $D/recursed_a/ $D/recursed_b/ | sortdupes)
@@ -283,4 +367,396 @@ END
     assertEquals "$exp" "$res"
 }
 
+test_jobs()
+{
+    res=$($FD --jobs=4 -r $D/ | sortdupes)
+    assertEquals 0 $?
+    exp=$($FD -r $D/ | sortdupes)
+    assertEquals "$exp" "$res"
+
+    res=$($FD -j0 -f $D/recursed_a/ $D/recursed_b/ | sortdupes)
+    assertEquals 0 $?
+    exp=$(sortdupes<<'END'
+testdir/recursed_b/three
+
+testdir/recursed_b/one
+
+END
+)
+    assertEquals "$exp" "$res"
+
+    $FD --jobs=-1 $D/two 2>/dev/null
+    assertEquals 1 $?
+}
+
+test_io_uring()
+{
+    res=$($FD --io=uring --queue-depth=2 -j2 -r $D/ 2>/dev/null | sortdupes)
+    assertEquals 0 $?
+    exp=$($FD -r $D/ | sortdupes)
+    assertEquals "$exp" "$res"
+
+    # with few descriptors, files wait for one rather than fail to open
+    mkdir -p $D.fds
+    for i in $(seq 1 300); do
+        head -c 4096 /dev/urandom > $D.fds/a$i
+        cp $D.fds/a$i $D.fds/b$i
+    done
+    exp=$($FD -rq -j8 $D.fds | sortdupes)
+    res=$(ulimit -n 64; $FD -rq -j8 --io=uring $D.fds 2>&1 | sortdupes)
+    assertEquals "$exp" "$res"
+
+    $FD --io=mmap $D/two 2>/dev/null
+    assertEquals 1 $?
+    $FD --io=uring --queue-depth=0 $D/two 2>/dev/null
+    assertEquals 1 $?
+}
+
+test_device_jobs()
+{
+    exp=$($FD -r $D/ 2>/dev/null | sortdupes)
+    for opts in "1" "2,3 -j2" "1 --io=uring" "1,2 --read-order=none"; do
+        res=$($FD -r --device-jobs=$opts $D/ 2>/dev/null | sortdupes)
+        assertEquals "$opts" "$exp" "$res"
+    done
+
+    for jobs in 0 1, ,2 1,0 x; do
+        $FD --device-jobs=$jobs $D/two 2>/dev/null
+        assertEquals "$jobs" 1 $?
+    done
+}
+
+test_compare_bytes()
+{
+    res=$($FD --compare=bytes $D/big | sortdupes)
+    assertEquals 0 $?
+    exp=$(sortdupes<<'END'
+testdir/big/big2_copy
+testdir/big/big2
+
+END
+)
+    assertEquals "$exp" "$res"
+
+    res=$($FD --compare=bytes --unique $D/big)
+    assertEquals 0 $?
+    assertEquals "testdir/big/big1" "$res"
+
+    res=$($FD --compare=bytes -j2 -r $D/ 2>/dev/null | sortdupes)
+    exp=$($FD -r $D/ 2>/dev/null | sortdupes)
+    assertEquals "$exp" "$res"
+
+    # a file reached through several hardlinks is read once
+    ln $D/big/big2 $D/hardlink_two
+    res=$($FD -H --compare=bytes --stats=$D.stats $D/big $D/hardlink_two \
+          2>/dev/null | sortdupes)
+    exp=$(sortdupes<<'END'
+testdir/big/big2_copy
+testdir/big/big2
+testdir/hardlink_two
+
+END
+)
+    assertEquals "$exp" "$res"
+    assertTrue "grep -q '\"name\":\"bytes\",.*\"files_opened\":3,' $D.stats"
+    rm -f $D.stats
+
+    # more distinct chunks than are kept in memory at once
+    mkdir -p $D.cmp
+    for i in $(seq 1 150); do
+        (head -c 4096 /dev/zero; printf '%04d' $((i % 100))) > $D.cmp/f$i
+    done
+    res=$($FD --compare=bytes -r $D.cmp | sortdupes)
+    exp=$($FD -r $D.cmp | sortdupes)
+    assertEquals "$exp" "$res"
+    assertEquals 100 "$(echo "$res" | grep -c .)"
+    rm -rf $D.cmp
+
+    $FD --compare=sha1 $D/two 2>/dev/null
+    assertEquals 1 $?
+}
+
+test_hash_engines()
+{
+    exp=$($FD -r $D/ 2>/dev/null | sortdupes)
+    for engine in blake3 xxh3; do
+        res=$($FD --hash=$engine -r $D/ 2>/dev/null | sortdupes)
+        assertEquals 0 $?
+        assertEquals "$exp" "$res"
+    done
+
+    $FD --hash=crc32 $D/two 2>/dev/null
+    assertEquals 1 $?
+}
+
+test_read_order()
+{
+    exp=$($FD -r $D/ 2>/dev/null | sortdupes)
+    for order in physical inode none; do
+        res=$($FD --read-order=$order -r $D/ 2>/dev/null | sortdupes)
+        assertEquals 0 $?
+        assertEquals "$exp" "$res"
+    done
+
+    $FD --read-order=random $D/two 2>/dev/null
+    assertEquals 1 $?
+}
+
+test_stages()
+{
+    exp=$($FD -r $D/ 2>/dev/null | sortdupes)
+    res=$($FD --stages=1,2,3K -r $D/ 2>/dev/null | sortdupes)
+    assertEquals 0 $?
+    assertEquals "$exp" "$res"
+
+    for stages in 0 4K,1K 4K, 1X 4K,,64K; do
+        $FD --stages=$stages $D/two 2>/dev/null
+        assertEquals "$stages" 1 $?
+    done
+}
+
+test_stream()
+{
+    exp=$($FD -r $D/ 2>/dev/null | sortdupes)
+    res=$($FD --stream -r $D/ 2>/dev/null | sortdupes)
+    assertEquals 0 $?
+    assertEquals "$exp" "$res"
+
+    exp=$($FD -ru $D/ 2>/dev/null | sort)
+    res=$($FD --stream -ru $D/ 2>/dev/null | sort)
+    assertEquals "$exp" "$res"
+}
+
+test_format()
+{
+    res=$($FD --format=nul $D/two $D/twice_one | tr '\0' '\n' | cut -d' ' -f1,2,6)
+    assertEquals 0 $?
+    exp=$(cat<<'END'
+1 4 testdir/two
+1 4 testdir/twice_one
+END
+)
+    assertEquals "$exp" "$res"
+
+    sets=$($FD -r -p '\x01' -P '\n' $D/ 2>/dev/null | wc -l)
+    res=$($FD --format=jsonl -r $D/ 2>/dev/null | grep -c '^{"id":[0-9]*,"size":[0-9]*,"digest":"[0-9a-f]*","files":\[{"path":"')
+    assertEquals "$sets" "$res"
+
+    res=$($FD --format=json $D/two $D/twice_one | sed -e 's/"dev":[0-9]*,"ino":[0-9]*/X/g')
+    exp=$(cat<<'END'
+[
+{"id":1,"size":4,"digest":"e34d218af2c45715ae79af7110d187d1","files":[{"path":"testdir/two",X},{"path":"testdir/twice_one",X}]}
+]
+END
+)
+    assertEquals "$exp" "$res"
+
+    # names are escaped, and those not UTF-8 are given in base64 as well
+    mkdir -p $D.json
+    for f in 'a"b' 'a\b' $'a\tb' $'caf\xc3\xa9' $'caf\xe9'; do
+        printf 'x\n' > "$D.json/$f"
+    done
+    res=$($FD --format=jsonl "$D.json/"* \
+          | sed -e 's/"dev":[0-9]*,"ino":[0-9]*/X/g' \
+                -e 's/"digest":"[0-9a-f]*"/"digest":D/' \
+                -e 's/\[{/[\n{/' -e 's/},{/}\n{/g' -e 's/}]}$/}\n]}/' \
+          | LC_ALL=C sort)
+    exp=$(printf '%s\n' ']}' '{"id":1,"size":2,"digest":D,"files":[' \
+          '{"path":"testdir.json/a\"b",X}' \
+          '{"path":"testdir.json/a\\b",X}' \
+          '{"path":"testdir.json/a\u0009b",X}' \
+          '{"path":"testdir.json/caf\''ufffd","path_b64":"dGVzdGRpci5qc29uL2NhZuk=",X}' \
+          '{"path":"testdir.json/café",X}')
+    assertEquals "$exp" "$res"
+
+    $FD --format=xml $D/two 2>/dev/null
+    assertEquals 1 $?
+}
+
+test_page_cache()
+{
+    mkdir -p $D.pc
+    head -c 9000005 /dev/urandom > $D.pc/a
+    cp $D.pc/a $D.pc/b
+    cp $D.pc/a $D.pc/c
+    printf x | dd of=$D.pc/c bs=1 seek=9000000 conv=notrunc 2>/dev/null
+    exp=$(printf '%s\n' $D.pc/a $D.pc/b)
+
+    for policy in keep drop direct; do
+        for opts in "" "--io=uring" "--compare=bytes" "--stages=1000"; do
+            res=$($FD -q --page-cache=$policy $opts $D.pc/a $D.pc/b $D.pc/c)
+            assertEquals "$policy $opts" "$exp" "$res"
+        done
+    done
+
+    $FD --page-cache=none $D/two 2>/dev/null
+    assertEquals 1 $?
+    rm -rf $D.pc
+}
+
+test_segment_size()
+{
+    mkdir -p $D.seg
+    head -c 3145733 /dev/urandom > $D.seg/a
+    cp $D.seg/a $D.seg/b
+    cp $D.seg/a $D.seg/c
+    printf x | dd of=$D.seg/c bs=1 seek=3145732 conv=notrunc 2>/dev/null
+    exp=$(printf '%s\n' $D.seg/a $D.seg/b)
+
+    for opts in "-j1" "-j3" "-j2 --io=uring" "-j2 --stages=4K,2M"; do
+        res=$($FD -q --segment-size=1M $opts $D.seg/a $D.seg/b $D.seg/c)
+        assertEquals "$opts" "$exp" "$res"
+    done
+
+    # signatures hashed whole are not reused for trees, nor the other way
+    for opts in "" "--segment-size=1M" "--segment-size=2M" ""; do
+        res=$($FD -q --cache=$D.cache $opts $D.seg/a $D.seg/b $D.seg/c)
+        assertEquals "$opts" "$exp" "$res"
+    done
+
+    for size in 1000 1023K 5G x; do
+        $FD --segment-size=$size $D/two 2>/dev/null
+        assertEquals "$size" 1 $?
+    done
+    rm -rf $D.seg $D.cache
+}
+
+test_stats()
+{
+    exp=$($FD -r $D/ 2>/dev/null)
+    res=$($FD --stats=$D.stats -r $D/ 2>/dev/null)
+    assertEquals "$exp" "$res"
+
+    sets=$($FD -r -p '\x01' -P '\n' $D/ 2>/dev/null | wc -l)
+    assertTrue "grep -q '\"duplicate_sets\":$sets,' $D.stats"
+    assertTrue "grep -q '{\"name\":\"walk\",' $D.stats"
+    assertTrue "grep -q '{\"name\":\"full\",' $D.stats"
+
+    res=$($FD -q --stats $D/two $D/twice_one 2>&1 >/dev/null | grep -o '"name":"[a-z]*"\|"reclaimable_bytes":[0-9]*')
+    exp=$(cat<<'END'
+"name":"walk"
+"name":"prefix"
+"reclaimable_bytes":4
+END
+)
+    assertEquals "$exp" "$res"
+
+    res=$($FD -rq --stats --compare=bytes $D/ 2>&1 >/dev/null | grep -c '{"name":"bytes",')
+    assertEquals 1 "$res"
+    rm -f $D.stats
+}
+
+test_memory_limit()
+{
+    mkdir -p $D.mem
+    for i in $(seq 1 2000); do
+        head -c $((i % 40)) $D/two > $D.mem/file$i
+    done
+
+    # which of several paths to a file is kept differs unless all are
+    for opts in "-j1" "-j3" "-u" "--compare=bytes" "link -H" "link -Hu"; do
+        if [ "${opts% *}" = link ]; then
+            ln -f $D.mem/file1 $D.mem/link1
+            opts=${opts#link }
+        fi
+        exp=$($FD -rq $opts $D/ $D.mem 2>/dev/null | sortdupes)
+        res=$($FD -rq --memory-limit=64K --stats=$D.stats $opts $D/ $D.mem \
+              2>/dev/null | sortdupes)
+        assertEquals "$opts" "$exp" "$res"
+        assertFalse "$opts" "grep -q '\"spilled_runs\":0}' $D.stats"
+    done
+
+    # with few descriptors, runs are merged into fewer ones a few at a time
+    exp=$($FD -rqH $D.mem 2>/dev/null | sortdupes)
+    res=$(ulimit -n 64; $FD -rqH -j8 --memory-limit=64K --stats=$D.stats \
+          $D.mem 2>/dev/null | sortdupes)
+    assertEquals "$exp" "$res"
+    runs=$(grep -o '"spilled_runs":[0-9]*' $D.stats | cut -d: -f2)
+    assertTrue "$runs runs" "[ $runs -gt 8 ]"
+
+    # the files of a size more than the limit holds are split by signature
+    mkdir -p $D.one
+    for i in $(seq 1 1000); do
+        printf '%04d\n' $((i % 250)) > $D.one/small$i
+        (head -c 4096 /dev/zero; printf '%04d\n' $((i % 250))) > $D.one/large$i
+    done
+    for opts in "" "link -H"; do
+        if [ "${opts% *}" = link ]; then
+            ln $D.one/large1 $D.one/link1
+            opts=${opts#link }
+        fi
+        exp=$($FD -rq $opts $D.one 2>/dev/null | sortdupes)
+        res=$($FD -rq $opts --memory-limit=64K --stats=$D.stats $D.one \
+              2>/dev/null | sortdupes)
+        assertEquals "$opts" "$exp" "$res"
+        runs=$(grep -o '"name":"prefix",[^}]*"runs":[0-9]*' $D.stats \
+               | sed 's/.*://')
+        assertTrue "$opts $runs runs" "[ $runs -gt 2 ]"
+    done
+    rm -rf $D.one
+
+    for size in 1000 63K x; do
+        $FD --memory-limit=$size $D/two 2>/dev/null
+        assertEquals "$size" 1 $?
+    done
+    rm -rf $D.mem $D.stats
+}
+
+test_cache()
+{
+    exp=$($FD -r $D/ 2>/dev/null | sortdupes)
+
+    # the first run fills the cache, the second one reads from it
+    for run in 1 2; do
+        res=$($FD --cache=$D.cache -r $D/ 2>/dev/null | sortdupes)
+        assertEquals 0 $?
+        assertEquals "$exp" "$res"
+        assertTrue "test -f $D.cache"
+    done
+
+    # a cache for another hash engine is ignored
+    res=$($FD --cache=$D.cache --hash=blake3 -r $D/ 2>/dev/null | sortdupes)
+    assertEquals "$exp" "$res"
+
+    # files changed in the last 2 seconds are not cached, so wait for them
+    mkdir -p $D.cached
+    echo same > $D.cached/a
+    echo same > $D.cached/b
+    echo diff > $D.cached/c
+    sleep 2
+    rm -f $D.cache
+    $FD -q --cache=$D.cache -r $D.cached >/dev/null 2>&1
+
+    # a second run takes every signature from the cache
+    res=$($FD -q --cache=$D.cache --stats=$D.stats -r $D.cached 2>/dev/null \
+          | sortdupes)
+    assertEquals "$(printf "%s\n" $D.cached/a $D.cached/b)" "$res"
+    assertTrue "grep -q '\"files_in\":3,.*\"bytes_read\":0,' $D.stats"
+    assertFalse "grep -q '\"bytes_read\":[1-9]' $D.stats"
+
+    # a file of the same size with a new mtime is hashed again
+    cat $D.cached/a > $D.cached/c
+    touch -d '+1 hour' $D.cached/c
+    res=$($FD -q --cache=$D.cache -r $D.cached 2>/dev/null | sortdupes)
+    assertEquals "$(printf "%s\n" $D.cached/[abc])" "$res"
+
+    # and so is a file of a new size
+    echo different > $D.cached/b
+    res=$($FD -q --cache=$D.cache -r $D.cached 2>/dev/null | sortdupes)
+    assertEquals "$(printf "%s\n" $D.cached/[ac])" "$res"
+    rm -rf $D.cached $D.stats
+
+    echo garbage > $D.cache
+    res=$($FD -q --cache=$D.cache $D/two $D/recursed_a/two 2>&1)
+    assertEquals 0 $?
+    exp=$(cat<<'END'
+ignoring signature cache testdir.cache: Invalid argument
+testdir/two
+testdir/recursed_a/two
+
+END
+)
+    assertEquals "$exp" "$res"
+}
+
 . shunit2
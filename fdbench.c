@@ -0,0 +1,373 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * Helper of bench.sh:
+ *
+ *   fdbench tree [options] dir   make a reproducible tree of synthetic files
+ *   fdbench evict dir            drop the files under dir from the page cache
+ *   fdbench run command...       run command with its output discarded and
+ *                                print what it cost
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (64 * 1024)
+
+struct treeopts {
+    size_t files;
+    off_t minsize, maxsize;
+    size_t nsizes;      // distinct file sizes, spaced evenly on a log scale
+    double dupratio;    // share of files copying the contents of another
+    double linkratio;   // share of files hardlinked to another
+    off_t prefix;       // bytes shared by files of the same size
+    unsigned depth, fanout;
+    uint64_t seed;
+};
+
+/**
+ * a file made so far, for duplicates and hardlinks to pick from
+ */
+struct treefile {
+    size_t sizeclass;
+    uint64_t seed;
+    char *path;
+};
+
+static uint64_t next(uint64_t *state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static double nextfraction(uint64_t *state)
+{
+    return (next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void fill(unsigned char *buf, size_t len, uint64_t *state)
+{
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t r = next(state);
+        memcpy(buf + i, &r, len - i < 8 ? len - i : 8);
+    }
+}
+
+static off_t classsize(const struct treeopts *o, size_t sizeclass)
+{
+    if (o->nsizes < 2)
+        return o->minsize;
+    double ratio = (double)o->maxsize / o->minsize;
+    return llround(o->minsize * pow(ratio, (double)sizeclass / (o->nsizes - 1)));
+}
+
+/**
+ * write the file at path with the contents given by its size class and seed:
+ * the shared prefix of its class, then bytes of its own
+ */
+static int writefile(const struct treeopts *o, const struct treefile *f)
+{
+    static unsigned char buf[BLOCK_SIZE];
+    uint64_t header = o->seed ^ (0x9e3779b97f4a7c15ULL * (f->sizeclass + 1));
+    uint64_t own = f->seed | 1;
+    off_t size = classsize(o, f->sizeclass);
+    off_t done = 0;
+
+    int fd = open(f->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "fdbench: could not create %s: %s\n", f->path,
+                strerror(errno));
+        return -1;
+    }
+    while (done < size) {
+        size_t len = size - done < BLOCK_SIZE ? size - done : BLOCK_SIZE;
+        size_t shared = done < o->prefix
+            ? (o->prefix - done < (off_t)len ? o->prefix - done : len) : 0;
+        fill(buf, shared, &header);
+        fill(buf + shared, len - shared, &own);
+        if (write(fd, buf, len) != (ssize_t)len) {
+            fprintf(stderr, "fdbench: could not write %s: %s\n", f->path,
+                    strerror(errno));
+            close(fd);
+            return -1;
+        }
+        done += len;
+    }
+    return close(fd);
+}
+
+/**
+ * make dir and depth levels of fanout subdirectories under it
+ */
+static int makedirs(const char *dir, unsigned depth, unsigned fanout)
+{
+    char path[PATH_MAX];
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "fdbench: could not create %s: %s\n", dir,
+                strerror(errno));
+        return -1;
+    }
+    if (depth == 0)
+        return 0;
+    for (unsigned i = 0; i < fanout; ++i) {
+        snprintf(path, sizeof path, "%s/d%02u", dir, i);
+        if (makedirs(path, depth - 1, fanout) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static int maketree(const struct treeopts *o, const char *dir)
+{
+    struct treefile *files = malloc(o->files * sizeof *files);
+    uint64_t state = o->seed | 1;
+    size_t ndirs = 1;
+
+    if (files == NULL || makedirs(dir, o->depth, o->fanout) == -1)
+        return -1;
+    for (unsigned i = 0; i < o->depth; ++i)
+        ndirs *= o->fanout;
+
+    for (size_t i = 0; i < o->files; ++i) {
+        struct treefile *f = &files[i];
+        size_t leaf = next(&state) % ndirs;
+        char path[PATH_MAX];
+        int len = snprintf(path, sizeof path, "%s", dir);
+
+        for (unsigned d = 0; d < o->depth; ++d, leaf /= o->fanout)
+            len += snprintf(path + len, sizeof path - len, "/d%02zu",
+                            leaf % o->fanout);
+        snprintf(path + len, sizeof path - len, "/f%07zu", i);
+        f->path = strdup(path);
+
+        double r = nextfraction(&state);
+        if (i > 0 && r < o->linkratio) {
+            const struct treefile *target = &files[next(&state) % i];
+            f->sizeclass = target->sizeclass;
+            f->seed = target->seed;
+            if (link(target->path, f->path) == -1) {
+                fprintf(stderr, "fdbench: could not link %s: %s\n", f->path,
+                        strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        if (i > 0 && r < o->linkratio + o->dupratio) {
+            const struct treefile *original = &files[next(&state) % i];
+            f->sizeclass = original->sizeclass;
+            f->seed = original->seed;
+        } else {
+            f->sizeclass = next(&state) % o->nsizes;
+            f->seed = next(&state);
+        }
+        if (writefile(o, f) == -1)
+            return -1;
+    }
+
+    for (size_t i = 0; i < o->files; ++i)
+        free(files[i].path);
+    free(files);
+    return 0;
+}
+
+static int parsesize(const char *str, off_t *size)
+{
+    char *end;
+    errno = 0;
+    double n = strtod(str, &end);
+    switch (*end) {
+    case 'K': n *= 1024; ++end; break;
+    case 'M': n *= 1024 * 1024; ++end; break;
+    case 'G': n *= 1024 * 1024 * 1024; ++end; break;
+    }
+    if (errno || end == str || (*end && *end != ':') || n < 0)
+        return -1;
+    *size = n;
+    return end - str;
+}
+
+static int treemain(int argc, char **argv)
+{
+    struct treeopts o = { 10000, 1024, 1024 * 1024, 32, 0.2, 0.02, 0, 3, 8,
+                          42 };
+    int opt, n;
+
+    while ((opt = getopt(argc, argv, "n:s:k:d:l:p:D:F:S:")) != -1) {
+        switch (opt) {
+        case 'n': o.files = strtoul(optarg, NULL, 10); break;
+        case 's':
+            if ((n = parsesize(optarg, &o.minsize)) == -1
+                    || optarg[n] != ':'
+                    || parsesize(optarg + n + 1, &o.maxsize) == -1
+                    || o.minsize > o.maxsize) {
+                fprintf(stderr, "fdbench: invalid size range: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k': o.nsizes = strtoul(optarg, NULL, 10); break;
+        case 'd': o.dupratio = atof(optarg); break;
+        case 'l': o.linkratio = atof(optarg); break;
+        case 'p':
+            if (parsesize(optarg, &o.prefix) == -1) {
+                fprintf(stderr, "fdbench: invalid prefix: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'D': o.depth = strtoul(optarg, NULL, 10); break;
+        case 'F': o.fanout = strtoul(optarg, NULL, 10); break;
+        case 'S': o.seed = strtoull(optarg, NULL, 10); break;
+        default:
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || o.nsizes < 1 || o.fanout < 1
+            || o.minsize < 1) {
+        fputs("usage: fdbench tree [-n files] [-s min:max] [-k nsizes]"
+              " [-d dupratio]\n       [-l linkratio] [-p prefix] [-D depth]"
+              " [-F fanout] [-S seed] dir\n", stderr);
+        return 1;
+    }
+    return maketree(&o, argv[optind]) == -1;
+}
+
+static int evictfile(const char *path, const struct stat *info, int type,
+    struct FTW *ftw)
+{
+    (void)info;
+    (void)ftw;
+    if (type != FTW_F)
+        return 0;
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    return 0;
+}
+
+static int evictmain(int argc, char **argv)
+{
+    if (argc != 2) {
+        fputs("usage: fdbench evict dir\n", stderr);
+        return 1;
+    }
+    if (nftw(argv[1], evictfile, 64, FTW_PHYS) == -1) {
+        fprintf(stderr, "fdbench: could not walk %s: %s\n", argv[1],
+                strerror(errno));
+        return 1;
+    }
+    // directory entries and inodes too, where allowed
+    FILE *drop = fopen("/proc/sys/vm/drop_caches", "w");
+    if (drop) {
+        sync();
+        fputs("3\n", drop);
+        fclose(drop);
+    }
+    return 0;
+}
+
+/**
+ * the I/O counters of this process and its waited for children
+ */
+struct iostats {
+    unsigned long long rchar, read_bytes, syscr, syscw;
+};
+
+static void getiostats(struct iostats *io)
+{
+    char line[128];
+    unsigned long long n;
+    FILE *file = fopen("/proc/self/io", "r");
+
+    memset(io, 0, sizeof *io);
+    if (file == NULL)
+        return;
+    while (fgets(line, sizeof line, file)) {
+        if (sscanf(line, "rchar: %llu", &n) == 1)
+            io->rchar = n;
+        else if (sscanf(line, "read_bytes: %llu", &n) == 1)
+            io->read_bytes = n;
+        else if (sscanf(line, "syscr: %llu", &n) == 1)
+            io->syscr = n;
+        else if (sscanf(line, "syscw: %llu", &n) == 1)
+            io->syscw = n;
+    }
+    fclose(file);
+}
+
+static double seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static int runmain(int argc, char **argv)
+{
+    struct iostats before, after;
+    struct timespec start, end;
+    struct rusage usage;
+    int status;
+
+    if (argc < 2) {
+        fputs("usage: fdbench run command...\n", stderr);
+        return 1;
+    }
+
+    getiostats(&before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execvp(argv[1], argv + 1);
+        _exit(127);
+    }
+    if (pid == -1 || wait4(pid, &status, 0, &usage) == -1) {
+        fprintf(stderr, "fdbench: could not run %s: %s\n", argv[1],
+                strerror(errno));
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getiostats(&after);
+
+    printf("%.3f %.3f %.3f %llu %llu %llu %llu %ld %d\n",
+           end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9,
+           seconds(&usage.ru_utime), seconds(&usage.ru_stime),
+           after.rchar - before.rchar, after.read_bytes - before.read_bytes,
+           after.syscr - before.syscr, after.syscw - before.syscw,
+           usage.ru_maxrss,
+           WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "tree") == 0)
+        return treemain(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "evict") == 0)
+        return evictmain(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "run") == 0)
+        return runmain(argc - 1, argv + 1);
+    fputs("usage: fdbench tree|evict|run ...\n", stderr);
+    return 1;
+}
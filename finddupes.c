@@ -23,28 +23,83 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+// for O_NOATIME and O_DIRECT
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/sysmacros.h>
+#endif
+#ifndef O_NOATIME
+#define O_NOATIME 0
+#endif
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
 #include "klib/khash.h"
-#include "klib/klist.h"
-#include "md5/md5.h"
+#include "arena.h"
+#include "cache.h"
+#include "hash.h"
+#include "spill.h"
+#include "uring.h"
 
 //#define printd(...) fprintf(stderr, __VA_ARGS__)
 #define printd(...) /* nothing */
 
-#define CHUNK_SIZE 8192
-#define PARTIAL_MD5_SIZE 4096
+#define CHUNK_SIZE (64 * 1024)
+// the most files and bytes of the groups handled at once with --stream,
+// unless a single group is larger
+#define STREAM_FILES 1024
+#define STREAM_BYTES ((off_t)256 << 20)
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+// milliseconds between updates of the progress line
+#define PROGRESS_INTERVAL 250
+#define URING_CHUNK_SIZE (128 * 1024)
+#define COMPARE_CHUNK_SIZE (64 * 1024)
+// the most distinct chunks of a round of comparegroup kept in memory
+#define MAX_COMPARE_BUFFERS 64
+// with --page-cache=direct, the least bytes read from a file to bypass the
+// page cache, and the alignment of the buffers, offsets and lengths of the
+// reads that do
+#define DIRECT_MIN_SIZE ((off_t)8 << 20)
+#define DIRECT_ALIGN 4096
+// the largest --segment-size, so that it fits the engine name of the cache
+#define MAX_SEGMENT_SIZE ((off_t)4 << 30)
+// the least --memory-limit
+#define MIN_MEMORY_LIMIT ((off_t)64 << 10)
+// the most spilled runs merged at once
+#define MAX_SPILL_FANIN 32
+// the most threads scanning directories, whatever --jobs
+#define MAX_WALKERS 16
+// with --page-cache=drop, the bytes read from a file between drops
+#define DROP_SIZE ((off_t)1 << 20)
+#define MAX_STAGES 16
+#define STAGE_GROWTH 16
 #define __nop_free(x)
 
 struct inodev {
@@ -52,16 +107,203 @@ struct inodev {
     dev_t dev;
 };
 
-KLIST_INIT(str, const char *, __nop_free)
-KLIST_INIT(inodev, struct inodev, __nop_free)
-KHASH_MAP_INIT_STR(str, klist_t(str)*)
+static inline khint_t inodevhash(struct inodev id)
+{
+    return kh_int64_hash_func((khint64_t)id.ino ^ (khint64_t)id.dev << 32);
+}
+
+static inline int inodevequal(struct inodev a, struct inodev b)
+{
+    return a.ino == b.ino && a.dev == b.dev;
+}
+
+/**
+ * signatures are computed in stages: stages 0 to nstages - 1 hash ever longer
+ * prefixes of the files, then SIG_FULL hashes their whole contents
+ */
+enum sigstage {
+    SIG_FULL = MAX_STAGES,
+    SIG_BYTES,  // identical contents; the digest holds a set serial number
+};
+
+/**
+ * the number of bytes hashed by each stage; 0 means the whole file
+ */
+off_t stagesizes[SIG_FULL + 1] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20 };
+size_t nstages = 4;
+
+/**
+ * the digest and size of a file, tagged with the stage it was computed in so
+ * that signatures from different passes never compare equal
+ */
+struct signature {
+    unsigned char digest[HASH_LEN];
+    unsigned char stage;
+    off_t size;
+};
+
+static inline khint_t sighash(struct signature sig)
+{
+    // digests are uniformly distributed already
+    khint32_t h;
+    memcpy(&h, sig.digest, sizeof h);
+    return h ^ sig.stage;
+}
+
+static inline int sigequal(struct signature a, struct signature b)
+{
+    return a.stage == b.stage && a.size == b.size
+        && memcmp(a.digest, b.digest, sizeof a.digest) == 0;
+}
+
+/**
+ * a directory holding files considered for duplicates. Its path is the path
+ * of its parent joined with its name, so that every name is stored just once.
+ */
+struct pathdir {
+    const struct pathdir *parent;   // NULL for a PATH argument
+    const char *name;
+    size_t len;         // of the path, including the separator if any
+    int sep;            // whether a '/' separates the path from the names in it
+};
+
+/**
+ * a file considered for duplicates, with the metadata of the one stat made of
+ * it while walking, carried through all passes
+ */
+struct fileinfo {
+    const struct pathdir *dir;      // NULL for a PATH argument
+    const char *name;   // allocated for this file only, so it identifies it
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;      // nanoseconds
+    int64_t ctime;      // nanoseconds
+    uint64_t diskpos;   // see getdiskpos, 0 until looked up
+};
+
+/**
+ * a growable array of files, as indices into filetab
+ */
+struct filelist {
+    size_t *files;
+    size_t n, max;
+};
+
+KHASH_MAP_INIT_INT64(size, struct filelist*)
+KHASH_INIT(inode, struct inodev, const char *, 1, inodevhash, inodevequal)
+// maps paths, cast to integers, to other paths or to indices
+KHASH_MAP_INIT_INT64(alias, const char *)
+KHASH_MAP_INIT_INT64(index, size_t)
+KHASH_INIT(sig, struct signature, struct filelist*, 1, sighash, sigequal)
 
 #ifdef GIT_VERSION
 const char VERSION[] = GIT_VERSION;
 #else
 const char VERSION[] = "0.2";
 #endif
+
+enum {
+    IO_STDIO,
+    IO_URING,
+};
+
+enum {
+    ORDER_NONE,
+    ORDER_INODE,
+    ORDER_PHYSICAL,
+};
+
+enum {
+    COMPARE_HASH,
+    COMPARE_BYTES,
+};
+enum {
+    PAGECACHE_KEEP,
+    PAGECACHE_DROP,
+    PAGECACHE_DIRECT,
+};
+enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_JSONL,
+    FORMAT_NUL,
+};
+
 int flags;
+long jobs = 1;
+int io = IO_STDIO;
+long queuedepth = 32;
+int compare = COMPARE_HASH;
+int readorder = ORDER_INODE;
+int pagecache = PAGECACHE_KEEP;
+// hash longer reads as trees of segments of this size in parallel, or 0
+off_t segmentsize = 0;
+// with --device-jobs, the threads hashing the files of each rotational disk
+// and of each other device at once, 0 for the latter meaning jobs; without,
+// rotationaljobs is 0 and jobs threads hash the files of all devices
+long rotationaljobs = 0, otherjobs = 0;
+// the files considered must have a size and a modification time within these
+// bounds; maxfilesize is -1 if there is no upper bound
+off_t minfilesize = 0, maxfilesize = -1;
+long long oldest = LLONG_MIN, newest = LLONG_MAX;
+// the levels of subdirectories walked below the PATH arguments, or -1
+long maxdepth = -1;
+/**
+ * shell patterns given with an option, matched against names, or against
+ * paths if they hold a '/'
+ */
+struct globlist {
+    const char **globs;
+    size_t n;
+};
+struct globlist includes, excludes, excludedirs;
+// cleared once opening a file with it is refused, as for files of others
+int noatime = O_NOATIME;
+int format = FORMAT_TEXT;
+unsigned long long nsets = 0;  // printed so far, numbering them
+const struct hashengine *hash = &hashengines[0];
+char *cachepath = NULL;
+struct sigcache *cache = NULL;
+// where the names of directories and files are stored, one per walker
+struct arena *arenas = NULL;
+// the records of all files considered for duplicates, in the order found
+struct fileinfo *filetab = NULL;
+size_t nfiletab = 0, maxfiletab = 0;
+// with --memory-limit, the bytes the records of the files found may take
+// before they are spilled to temporary files, where they are merged from, and
+// how many there are
+off_t memorylimit = 0;
+struct spill *spill = NULL;
+size_t nspilled = 0;
+// the files of a size too many for the limit, by signature, see spillfiles,
+// and the runs written for them
+struct spill *splitspill = NULL;
+size_t splitruns = 0;
+// descriptors kept for the runs of spill being merged, see fdbudget
+size_t spillfds = 0;
+// where to write the --stats report, "-" for stderr, or NULL
+char *statspath = NULL;
+// counters of the pass being run, updated by all threads
+unsigned long long statsbytes = 0, statsopened = 0, statserrors = 0;
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+/**
+ * what a pass did, for --stats; the runs of a pass over the windows of
+ * --stream add up
+ */
+struct passstats {
+    size_t runs, filesin, filesout, groups;
+    unsigned long long bytes, opened, errors;
+    double wall, cpu;               // seconds
+    double startwall, startcpu;     // of the run in progress
+};
+// the walk, then the signature passes by stage
+struct passstats walkstats, stagestats[SIG_BYTES + 1];
+// the sets of duplicates printed, their files and bytes, and the bytes
+// replacing all but one copy of each by hardlinks would free
+unsigned long long statssets = 0, statsfiles = 0, statsdupbytes = 0, statsreclaim = 0;
+// the paths kept to files reached before through other paths, see keepinode
+khash_t(alias) *aliases = NULL;
 char *sep = "\n";
 size_t seplen = 1;
 char *setsep = "\n\n";
@@ -77,6 +319,8 @@ enum {
     F_UNIQUE            =  1 << 7,
     F_SEPARATOR         =  1 << 8,
     F_SETSEPARATOR      =  1 << 9,
+    F_STREAM            =  1 << 10,
+    F_ONEFILESYSTEM     =  1 << 11,
 };
 
 int fromhex(unsigned char c)
@@ -175,6 +419,7 @@ out:
 
 void errormsg(const char *message, ...)
 {
+    COUNT(statserrors, 1);
     va_list ap;
     va_start(ap, message);
     vfprintf(stderr, message, ap);
@@ -191,9 +436,55 @@ void usage(void)
           "                  \tdisk area they are treated as non-duplicates; this\n"
           "                  \toption will change this behavior\n"
           " -n --noempty     \texclude zero-length files from consideration\n"
+          "    --min-size=size\texclude files smaller than size bytes\n"
+          "    --max-size=size\texclude files larger than size bytes\n"
+          "    --include=glob\tconsider only files with names, or paths if glob\n"
+          "                  \tholds a '/', matching some glob\n"
+          "    --exclude=glob\texclude files with names or paths matching glob\n"
+          "    --exclude-dir=glob\tdo not walk directories with names or paths\n"
+          "                  \tmatching glob\n"
+          "    --max-depth=N \twalk at most N levels of subdirectories\n"
+          "    --one-file-system\tdo not walk into other file systems\n"
+          "    --min-age=age \texclude files modified less than age ago, in days\n"
+          "                  \tor with a unit: s, m, h, d or w\n"
+          "    --max-age=age \texclude files modified more than age ago\n"
           " -f --omitfirst   \tomit the first file in each set of matches\n"
           " -u --unique      \tlist only files that don't have duplicates\n"
           " -q --quiet       \thide progress indicator\n"
+          " -j --jobs=N      \tscan directories and compute signatures with N\n"
+          "                  \tthreads; 0 means one thread per online processor\n"
+          "                  \t(default 1)\n"
+          "    --device-jobs=N[,M]\thash the files of each rotational disk with\n"
+          "                  \tN threads and of each other device with M (default\n"
+          "                  \tas many as --jobs), all devices at once\n"
+          "    --io=method   \tread files with stdio (default) or uring, which\n"
+          "                  \tkeeps several reads in flight through io_uring\n"
+          "    --queue-depth=N\tkeep up to N reads in flight per thread with\n"
+          "                  \t--io=uring (default 32)\n"
+          "    --read-order=order\tread files sorted by inode number (default),\n"
+          "                  \tby physical location on disk, or none\n"
+          "    --stages=list \thash files in stages of ever longer prefixes\n"
+          "                  \tbefore whole, skipping those unlikely to help\n"
+          "                  \t(default 4K,64K,1M,16M)\n"
+          "    --page-cache=policy\tkeep (default) the contents read in the page\n"
+          "                  \tcache, drop them, or bypass it for large files\n"
+          "    --hash=engine \thash files with md5 (default), blake3 or xxh3\n"
+          "    --segment-size=size\thash reads longer than size in segments of\n"
+          "                  \tthat size in parallel, combined as a tree\n"
+          "    --cache=file  \treuse the signatures stored in file by previous\n"
+          "                  \truns for files that did not change since\n"
+          "    --compare=method\tconfirm duplicates by hash signature (default) or\n"
+          "                  \tby comparing bytes, which stops reading files as\n"
+          "                  \tsoon as they differ from all others\n"
+          "    --stream      \tprint each set of duplicates as soon as it is\n"
+          "                  \tfound, smallest files first\n"
+          "    --memory-limit=size\tspill the records of the files found to\n"
+          "                  \ttemporary files once they take size bytes, and\n"
+          "                  \tmerge them back by size as with --stream\n"
+          "    --format=format\tprint sets as text (default), json, jsonl or nul\n"
+          "                  \trecords, with size, digest, device and inode\n"
+          "    --stats[=file]\twrite the counters and times of each pass and the\n"
+          "                  \tduplicate totals as JSON to file or stderr\n"
           " -p --separator=sep\tseparate files with sep string instead of '\\n'\n"
           " -P --setseparator=sep  separate sets with sep string instead of '\\n\\n'\n"
           " -v --version     \tdisplay finddupes version\n"
@@ -222,437 +513,3265 @@ char *joinpath(const char *dir, const char *filename)
     return fpath;
 }
 
-char *getsignatureuntil(const char *filename, off_t max_read, off_t fsize)
+/**
+ * @return a node allocated from arena for the directory name in parent
+ */
+struct pathdir *newpathdir(struct arena *arena, const struct pathdir *parent,
+    const char *name)
 {
-//    printd("-- %s filename %s\n", __func__, filename);
-
-    md5_state_t state;
-    md5_byte_t digest[16];
+    struct pathdir *dir = arena_alloc(arena, sizeof *dir,
+                                      __alignof__(struct pathdir));
+    size_t namelen = strlen(name);
 
-    md5_init(&state);
+    dir->parent = parent;
+    dir->name = arena_strndup(arena, name, namelen);
+    // as joinpath() does
+    dir->sep = namelen > 0 && name[namelen - 1] != '/';
+    dir->len = (parent ? parent->len : 0) + namelen + dir->sep;
+    return dir;
+}
 
-    // always include file size in the signature
-    md5_append(&state, (md5_byte_t*)&fsize, sizeof fsize);
+/**
+ * @return the path of the file f in a heap allocated string
+ */
+char *filepath(const struct fileinfo *f)
+{
+    size_t len = f->dir ? f->dir->len : 0;
+    size_t namelen = strlen(f->name);
+    char *path = malloc(len + namelen + 1);
 
-    if (filename) { // include (partial) file contents only if asked to
-        off_t toread;
-        static md5_byte_t chunk[CHUNK_SIZE];
-        FILE *file;
+    memcpy(path + len, f->name, namelen + 1);
+    for (const struct pathdir *dir = f->dir; dir; dir = dir->parent) {
+        if (dir->sep)
+            path[--len] = '/';
+        namelen = len - (dir->parent ? dir->parent->len : 0);
+        len -= namelen;
+        memcpy(path + len, dir->name, namelen);
+    }
+    return path;
+}
 
-        if (max_read != 0 && fsize > max_read)
-            fsize = max_read;
+/**
+ * @return the length of the valid UTF-8 sequence of more than one byte at p,
+ * or 0 if there is none
+ */
+size_t utf8len(const unsigned char *p)
+{
+    size_t len = 0;
 
-        file = fopen(filename, "rb");
-        if (file == NULL) {
-            errormsg("error opening file %s\n", filename);
-            return NULL;
-        }
+    if (*p >= 0xc2 && *p <= 0xdf)
+        len = 2;
+    else if (*p >= 0xe0 && *p <= 0xef)
+        len = 3;
+    else if (*p >= 0xf0 && *p <= 0xf4)
+        len = 4;
+    for (size_t i = 1; i < len; ++i)
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+    // no overlong forms, surrogates or code points past U+10FFFF
+    if ((p[0] == 0xe0 && p[1] < 0xa0) || (p[0] == 0xed && p[1] > 0x9f)
+            || (p[0] == 0xf0 && p[1] < 0x90)
+            || (p[0] == 0xf4 && p[1] > 0x8f))
+        return 0;
+    return len;
+}
 
-        while (fsize > 0) {
-            toread = (fsize % CHUNK_SIZE) ? (fsize % CHUNK_SIZE) : CHUNK_SIZE;
-            if (fread(chunk, toread, 1, file) != 1) {
-                errormsg("error reading from file %s\n", filename);
-                fclose(file);
-                return NULL;
-            }
-            md5_append(&state, chunk, toread);
-            fsize -= toread;
-        }
+/**
+ * @return 1 if str is valid UTF-8
+ */
+int isutf8(const char *str)
+{
+    const unsigned char *p = (const unsigned char *)str;
 
-        fclose(file);
+    while (*p) {
+        size_t len = utf8len(p);
+        if (len == 0 && *p >= 0x80)
+            return 0;
+        p += len ? len : 1;
     }
+    return 1;
+}
 
-    md5_finish(&state, digest);
+/**
+ * write str to stdout escaped for a JSON string; bytes that are not part of
+ * valid UTF-8 sequences are written as U+FFFD, which no byte of a valid name
+ * turns into, so the name is to be taken from the bytes printed apart
+ */
+void putjsonstr(const char *str)
+{
+    const unsigned char *p = (const unsigned char *)str;
 
-    char signature[16*2 + 1];
-    char *sigp = signature;
-    static const char hexdigits[] = "0123456789abcdef";
-    for (int x = 0; x < 16; x++) {
-        md5_byte_t digit0 = digest[x] % 16;
-        md5_byte_t digit1 = (digest[x] - digit0) / 16;
-        *sigp++ = hexdigits[digit1];
-        *sigp++ = hexdigits[digit0];
-    }
-    *sigp = '\0';
+    while (*p) {
+        size_t len = utf8len(p);
 
-    return strdup(signature);
+        if (len > 0) {
+            fwrite(p, 1, len, stdout);
+            p += len;
+        } else if (*p >= 0x80) {
+            fputs("\\ufffd", stdout);
+            ++p;
+        } else if (*p == '"' || *p == '\\') {
+            putchar('\\');
+            putchar(*p++);
+        } else if (*p < 0x20 || *p == 0x7f)
+            printf("\\u%04x", *p++);
+        else
+            putchar(*p++);
+    }
 }
 
-char *getfullsignature(const char *filename, off_t fsize)
+void putstr(const char *str)
 {
-    return getsignatureuntil(filename, 0, fsize);
+    fputs(str, stdout);
 }
 
-char *getpartialsignature(const char *filename, off_t fsize)
+void putdirpath(const struct pathdir *dir, void (*put)(const char *))
 {
-    return getsignatureuntil(filename, PARTIAL_MD5_SIZE, fsize);
+    if (dir == NULL)
+        return;
+    putdirpath(dir->parent, put);
+    put(dir->name);
+    if (dir->sep)
+        put("/");
 }
 
-char *getfilesizesignature(off_t fsize)
+/**
+ * write the path of the file f to stdout with put
+ */
+void putfilepath(const struct fileinfo *f, void (*put)(const char *))
 {
-    return getsignatureuntil(NULL, 0, fsize);
+    putdirpath(f->dir, put);
+    put(f->name);
 }
 
 /**
- * @param fpath a heap allocated string; the function takes ownership of fpath
+ * @return 1 if the path of the file f is valid UTF-8
  */
-void grokfile(const char *fpath, const struct stat *info, khash_t(str) *files)
+int isutf8path(const struct fileinfo *f)
 {
-//    printd("-- %s %s\n", __func__, fpath);
+    if (!isutf8(f->name))
+        return 0;
+    for (const struct pathdir *dir = f->dir; dir; dir = dir->parent)
+        if (!isutf8(dir->name))
+            return 0;
+    return 1;
+}
 
-    struct stat linfo;
+/**
+ * write the path of the file f to stdout in base64
+ */
+void putbase64path(const struct fileinfo *f)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *path = filepath(f);
+    const unsigned char *p = (const unsigned char *)path;
+    size_t len = strlen(path);
 
-    static const char indicator[] = "-\\|/";
-    static int progress = 0;
-    if (!(flags & F_HIDEPROGRESS)) {
-        fprintf(stderr, "\rscanning files %c ", indicator[progress]);
-        progress = (progress + 1) % 4;
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned long v = (unsigned long)p[i] << 16;
+        if (i + 1 < len)
+            v |= (unsigned long)p[i + 1] << 8;
+        if (i + 2 < len)
+            v |= p[i + 2];
+        putchar(digits[v >> 18 & 63]);
+        putchar(digits[v >> 12 & 63]);
+        putchar(i + 1 < len ? digits[v >> 6 & 63] : '=');
+        putchar(i + 2 < len ? digits[v & 63] : '=');
     }
+    free(path);
+}
 
-    if (lstat(fpath, &linfo) == -1) {
-        errormsg("lstat failed: %s: %s\n", fpath, strerror(errno));
-        return;
+/**
+ * format sig as a hexadecimal string in buf, which must hold at least
+ * 2*HASH_LEN + 1 chars
+ */
+char *sigtostr(const struct signature *sig, char *buf)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    char *p = buf;
+    for (int x = 0; x < HASH_LEN; x++) {
+        *p++ = hexdigits[sig->digest[x] / 16];
+        *p++ = hexdigits[sig->digest[x] % 16];
     }
+    *p = '\0';
+    return buf;
+}
 
-    if (!(S_ISREG(linfo.st_mode)
-            || (S_ISLNK(linfo.st_mode) && flags & F_FOLLOWLINKS))) {
-        printd("-- %s skipping non-regular or symlink file %s\n", __func__, fpath);
-        goto out2;
-    }
+static double wallclock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    if (info->st_size == 0 && flags & F_EXCLUDEEMPTY) {
-        printd("-- %s skipping empty file %s\n", __func__, fpath);
-        goto out2;
-    }
+static double cpuclock(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
 
-    const char *sig = getfilesizesignature(info->st_size);
-    if (!sig) {
-        goto out2;
-    }
-//        printd("-- %s %s %u %s\n", __func__, sig, (unsigned)strlen(sig), fpath);
+/**
+ * the pass the progress line reports on, set while no other thread runs
+ */
+struct progress {
+    const char *name;
+    off_t length;                   // of the prefix hashed, or 0
+    size_t totalfiles;              // 0 if unknown, when walking
+    unsigned long long totalbytes;
+    double start;
+};
+struct progress progress;
+// files done and bytes read by the pass, updated by all threads; apart from
+// the counters of --stats, which passes reset on their own
+size_t progressfiles = 0;
+unsigned long long progressbytes = 0;
+// when the progress line is next due, in milliseconds of wallclock()
+unsigned long long progressdue = 0;
+// the length of the progress line on screen, to blank it out
+int progresslen = 0;
+pthread_mutex_t progresslock = PTHREAD_MUTEX_INITIALIZER;
 
-    int ret;
-    khiter_t k = kh_put(str, files, sig, &ret);
-//        printd("-- %s kh_put sig %s ret %d\n", __func__, sig, ret);
+/**
+ * start reporting progress on the pass name over totalfiles files of
+ * totalbytes bytes, hashing their first length bytes if not 0
+ */
+void startprogress(const char *name, off_t length, size_t totalfiles,
+    unsigned long long totalbytes)
+{
+    progress.name = name;
+    progress.length = length;
+    progress.totalfiles = totalfiles;
+    progress.totalbytes = totalbytes;
+    progress.start = wallclock();
+    progressfiles = 0;
+    progressbytes = 0;
+    progressdue = progress.start * 1000 + PROGRESS_INTERVAL;
+}
 
-    klist_t(str) *dupes;
+/**
+ * count n bytes read for --stats and for the progress line
+ */
+static inline void countread(unsigned long long n)
+{
+    COUNT(statsbytes, n);
+    COUNT(progressbytes, n);
+}
 
-    switch (ret) {
-    case -1:
-        errormsg("%s error in kh_put()\n", __func__);
-        goto out1;
-    case 0:
-//            printd("-- %s key already present\n", __func__);
-        free((char*)sig);
-        dupes = kh_value(files, k);
-        break;
-    default:
-        dupes = kl_init(str);
-        kh_value(files, k) = dupes;
-        break;
-    }
+/**
+ * blank out the progress line, if any; no other thread may be running
+ */
+void endprogress(void)
+{
+    if (progresslen > 0)
+        fprintf(stderr, "\r%*s\r", progresslen, "");
+    progresslen = 0;
+}
 
-    *kl_pushp(str, dupes) = fpath;
-    return;
+static int formatsize(char *buf, size_t len, unsigned long long size)
+{
+    static const char units[] = "KMGTP";
+    double n = size;
+    int unit = -1;
 
-out1:
-    free((char*)sig);
-out2:
-    free((char*)fpath);
+    while (n >= 1024 && unit < (int)sizeof units - 2) {
+        n /= 1024;
+        ++unit;
+    }
+    if (unit < 0)
+        return snprintf(buf, len, "%lluB", size);
+    return snprintf(buf, len, "%.1f%c", n, units[unit]);
 }
 
-void grokdir(const char *dir, khash_t(str) *files)
+static void printprogress(double now)
 {
-//    printd("-- %s %s\n", __func__, dir);
+    char line[160], done[16], total[16], rate[16];
+    double elapsed = now - progress.start;
+    size_t files = __atomic_load_n(&progressfiles, __ATOMIC_RELAXED);
+    unsigned long long bytes = __atomic_load_n(&progressbytes,
+                                               __ATOMIC_RELAXED);
+    int len = 0;
 
-    DIR *cd;
-    struct dirent *dirinfo;
-    struct stat info;
-    struct stat linfo;
+    if (progress.length) {
+        formatsize(total, sizeof total, progress.length);
+        len = snprintf(line, sizeof line, "\r%s %s: ", progress.name, total);
+    } else
+        len = snprintf(line, sizeof line, "\r%s: ", progress.name);
 
-    if (lstat(dir, &linfo) == -1) {
-        errormsg("lstat failed: %s: %s\n", dir, strerror(errno));
-        return;
+    if (progress.totalfiles == 0)
+        len += snprintf(line + len, sizeof line - len, "%zu files, %.0f/s",
+                        files, elapsed > 0 ? files / elapsed : 0);
+    else {
+        double bps = elapsed > 0 ? bytes / elapsed : 0;
+        formatsize(done, sizeof done, bytes);
+        formatsize(total, sizeof total, progress.totalbytes);
+        formatsize(rate, sizeof rate, bps);
+        len += snprintf(line + len, sizeof line - len,
+                        "%zu/%zu files, %s/%s, %s/s", files,
+                        progress.totalfiles, done, total, rate);
+        if (bps > 0 && bytes < progress.totalbytes) {
+            unsigned long eta = (progress.totalbytes - bytes) / bps;
+            len += snprintf(line + len, sizeof line - len,
+                            ", ETA %lu:%02lu:%02lu", eta / 3600,
+                            eta / 60 % 60, eta % 60);
+        }
     }
+    if (len >= (int)sizeof line)
+        len = sizeof line - 1;
 
-    if (!(flags & F_FOLLOWLINKS) && S_ISLNK(linfo.st_mode))
-        return;
+    // blank out what is left of a longer line before
+    int pad = progresslen > len - 1 ? progresslen - (len - 1) : 0;
+    fprintf(stderr, "%s%*s", line, pad, "");
+    progresslen = len - 1 + pad;
+}
 
-    cd = opendir(dir);
-    if (!cd) {
-        errormsg("could not chdir to %s: %s\n", dir, strerror(errno));
+/**
+ * update the progress line if it is due, which costs a clock read otherwise
+ */
+void showprogress(void)
+{
+    if (flags & F_HIDEPROGRESS)
+        return;
+    double now = wallclock();
+    unsigned long long ms = now * 1000;
+    if (ms < __atomic_load_n(&progressdue, __ATOMIC_RELAXED)
+            || pthread_mutex_trylock(&progresslock) != 0)
         return;
+    if (ms >= progressdue) {
+        __atomic_store_n(&progressdue, ms + PROGRESS_INTERVAL,
+                         __ATOMIC_RELAXED);
+        printprogress(now);
     }
+    pthread_mutex_unlock(&progresslock);
+}
 
-    while ((dirinfo = readdir(cd)) != NULL) {
-        if (strcmp(dirinfo->d_name, ".") == 0
-                || strcmp(dirinfo->d_name, "..") == 0)
-            continue;
+/**
+ * open the file at path to read its first len bytes, without updating its
+ * access time where allowed, with more read ahead if more than a chunk, and
+ * with --page-cache=direct bypassing the page cache for DIRECT_MIN_SIZE bytes
+ * or more where the file system allows it
+ *
+ * @param direct set to whether the page cache is bypassed
+ * @return the file descriptor, or -1 with errno set
+ */
+int openfile(const char *path, off_t len, int *direct)
+{
+    int oflags = O_RDONLY | __atomic_load_n(&noatime, __ATOMIC_RELAXED);
+    int fd;
 
-        const char *fpath = joinpath(dir, dirinfo->d_name);
+    if (pagecache == PAGECACHE_DIRECT && len >= DIRECT_MIN_SIZE)
+        oflags |= O_DIRECT;
+    while ((fd = open(path, oflags)) == -1) {
+        if (errno == EPERM && oflags & O_NOATIME) {
+            __atomic_store_n(&noatime, 0, __ATOMIC_RELAXED);
+            oflags &= ~O_NOATIME;
+        } else if (errno == EINVAL && oflags & O_DIRECT)
+            oflags &= ~O_DIRECT;
+        else
+            return -1;
+    }
+    COUNT(statsopened, 1);
 
-        if (stat(fpath, &info) == -1) {
-            errormsg("stat failed: %s: %s\n", fpath, strerror(errno));
-            free((char*)fpath);
-            continue;
-        }
+    *direct = O_DIRECT && oflags & O_DIRECT;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (!*direct && len > CHUNK_SIZE)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return fd;
+}
 
-        if (S_ISDIR(info.st_mode)) {
-            if (flags & F_RECURSE)
-                grokdir(fpath, files);
-            free((char*)fpath);
-        } else
-            grokfile(fpath, &info, files);
-    }
-    closedir(cd);
+/**
+ * with --page-cache=drop or direct, drop the pages of fd read up to end from
+ * the page cache once DROP_SIZE bytes or more were read since the last drop
+ * at *dropped
+ *
+ * @param last 1 to drop them right away, 2 to drop those read ahead past end
+ * as well, 0 to wait for more
+ */
+void dropconsumed(int fd, off_t *dropped, off_t end, int last)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (pagecache == PAGECACHE_KEEP || (!last && end - *dropped < DROP_SIZE))
+        return;
+    // pages are dropped in whole folios, which may straddle the end of the
+    // range dropped last time
+    off_t start = *dropped > DROP_SIZE ? *dropped - DROP_SIZE : 0;
+    posix_fadvise(fd, start, last == 2 ? 0 : end - start,
+                  POSIX_FADV_DONTNEED);
+    *dropped = end;
+#endif
 }
 
 /**
- * move files for which the signature given by signaturefunction
- * differs from the current partial signature from files to checked_files
+ * @return len rounded up to whole blocks if reads of fd bypass the page cache
  */
-void checkdupes(khint_t k, khash_t(str) *files, khash_t(str) *checked_files,
-    char *(*signaturefunction)(const char *filename, off_t fsize))
+static size_t directlen(size_t len, int direct)
 {
-//    printd("%s files[%s]\n", __func__, kh_key(files, k));
-    klist_t(str) *dupes = kh_value(files, k);
-    kliter_t(str) *p;
+    return direct ? (len + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1)
+                  : len;
+}
 
-    if (kl_begin(dupes) == kl_end(dupes) // empty?
-            || kl_next(kl_begin(dupes)) == kl_end(dupes)) { // size == 1?
-//        printd("%s no dupes for %s\n", __func__, kh_key(files, k));
-        return;
+/**
+ * read up to len bytes from fd at offset into buf, less only at the end of
+ * the file
+ *
+ * @return the number of bytes read, or -1 on error
+ */
+ssize_t preadfull(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
     }
+    return done;
+}
 
-    const char *partsig = kh_key(files, k); // current partial signature
-    klist_t(str) *filtered_dupes = kl_init(str);
-    struct stat info;
+/**
+ * add len bytes of the file at path from offset to state
+ *
+ * @param tail whether nothing past the range is to be read, for dropconsumed
+ * @return 0 on success, -1 on error
+ */
+int hashrange(const char *path, off_t offset, off_t len,
+    union hashstate *state, int tail)
+{
+    unsigned char chunk[CHUNK_SIZE] __attribute__((aligned(DIRECT_ALIGN)));
+    off_t done = 0, dropped = offset;
+    int direct;
 
-    for (p = kl_begin(dupes); p != kl_end(dupes); p = kl_next(p)) {
-        const char *fpath = kl_val(p);
+    int fd = openfile(path, len, &direct);
+    if (fd == -1) {
+        errormsg("error opening file %s\n", path);
+        return -1;
+    }
 
-        if (stat(fpath, &info) == -1) {
-            errormsg("stat failed: %s: %s\n", fpath, strerror(errno));
-            continue;
+    while (done < len) {
+        size_t toread = len - done < CHUNK_SIZE ? len - done : CHUNK_SIZE;
+        if (preadfull(fd, chunk, directlen(toread, direct), offset + done)
+                < (ssize_t)toread) {
+            errormsg("error reading from file %s\n", path);
+            close(fd);
+            return -1;
         }
+        hash->update(state, chunk, toread);
+        countread(toread);
+        done += toread;
+        if (!direct)
+            dropconsumed(fd, &dropped, offset + done,
+                         done < len ? 0 : tail ? 2 : 1);
+        showprogress();
+    }
 
-        const char *newsig = signaturefunction(fpath, info.st_size);
-        if (!newsig)
-            continue;
+    close(fd);
+    return 0;
+}
 
-//        printd("-- %s %s newsig %s\n", __func__, fpath, newsig);
+int getsignatureuntil(const char *filename, off_t max_read, off_t fsize,
+    struct signature *sig)
+{
+//    printd("-- %s filename %s\n", __func__, filename);
 
-        if (strcmp(newsig, partsig) == 0) {
-//            printd("-- %s newsig == partsig, continuing\n", __func__);
-            free((char*)newsig);
-            *kl_pushp(str, filtered_dupes) = fpath;
-            continue;
-        }
+    union hashstate state;
 
-        int ret;
-        khiter_t checked_k = kh_put(str, checked_files, newsig, &ret);
-//        printd("-- %s kh_put newsig %s ret %d\n", __func__, newsig, ret);
+    hash->init(&state);
 
-        klist_t(str) *checked_dupes;
+    // always include file size in the signature
+    hash->update(&state, &fsize, sizeof fsize);
 
-        switch (ret) {
-        case -1:
-            errormsg("%s error in kh_put()\n", __func__);
-            free((char*)newsig);
-            continue;
-        case 0:
-//            printd("-- %s key already present\n", __func__);
-            free((char*)newsig);
-            checked_dupes = kh_value(checked_files, checked_k);
-            break;
-        default:
-            checked_dupes = kl_init(str);
-            kh_value(checked_files, checked_k) = checked_dupes;
-            break;
-        }
+    if (max_read != 0 && fsize > max_read)
+        fsize = max_read;
 
-        *kl_pushp(str, checked_dupes) = fpath;
-    }
+    if (hashrange(filename, 0, fsize, &state, 1) == -1)
+        return -1;
 
-    if (kl_begin(filtered_dupes) == kl_end(filtered_dupes)) {
-        // filtered_dupes is empty; remove files entry at k
-        kh_del(str, files, k);
-        free((char*)partsig);
-        kl_destroy(str, filtered_dupes);
-    } else // replace files entry at k
-        kh_value(files, k) = filtered_dupes;
+    hash->final(&state, sig->digest);
 
-    kl_destroy(str, dupes);
+    return 0;
 }
 
 /**
- * remove from the list at k all paths pointing to the same inode and device,
- * except the first occurrence
+ * @return the number of bytes of a file of size fsize hashed by stage
  */
-void checkinodes(khint_t k, khash_t(str) *files)
+off_t hashedlen(enum sigstage stage, off_t fsize)
 {
-//    printd("%s files[%s]\n", __func__, kh_key(files, k));
-    klist_t(str) *dupes = kh_value(files, k);
-    kliter_t(str) *p;
-
-    if (kl_begin(dupes) == kl_end(dupes) // empty?
-            || kl_next(kl_begin(dupes)) == kl_end(dupes)) { // size == 1?
-//        printd("%s no dupes for %s\n", __func__, kh_key(files, k));
-        return;
-    }
-
-    struct stat info;
-    klist_t(inodev) *inodes = kl_init(inodev);
-    klist_t(str) *filtered_dupes = kl_init(str);
+    off_t len = stagesizes[stage];
+    return len != 0 && len < fsize ? len : fsize;
+}
 
-    for (p = kl_begin(dupes); p != kl_end(dupes); p = kl_next(p)) {
-        const char *fpath = kl_val(p);
+int getsignature(const char *filename, enum sigstage stage, off_t fsize,
+    struct signature *sig)
+{
+    sig->stage = stage;
+    sig->size = fsize;
+    return getsignatureuntil(filename, stagesizes[stage], fsize, sig);
+}
 
-        if (stat(fpath, &info) == -1) {
-            errormsg("stat failed: %s: %s\n", fpath, strerror(errno));
-            continue;
-        }
+/**
+ * tell whether the file fpath is to be considered when looking for duplicates
+ *
+ * @param info the result of stat()ing fpath
+ * @param islink whether fpath itself is a symlink
+ */
+int acceptfile(const char *fpath, const struct stat *info, int islink)
+{
+    COUNT(progressfiles, 1);
+    showprogress();
 
-        kliter_t(inodev) *i;
-        for (i = kl_begin(inodes); i != kl_end(inodes); i = kl_next(i))
-            if (kl_val(i).ino == info.st_ino && kl_val(i).dev == info.st_dev)
-                break;
+    if (!S_ISREG(info->st_mode) || (islink && !(flags & F_FOLLOWLINKS))) {
+        printd("-- %s skipping non-regular or symlink file %s\n", __func__, fpath);
+        return 0;
+    }
 
-        if (i == kl_end(inodes)) {
-            printd("-- %s found new inode %llu pointing at %s\n",
-                   __func__, (unsigned long long)(info.st_ino), fpath);
-            struct inodev id = { info.st_ino, info.st_dev };
-            *kl_pushp(inodev, inodes) = id;
-            *kl_pushp(str, filtered_dupes) = fpath;
-        } else {
-            if (flags & F_FOLLOWLINKS) {
-                if (lstat(fpath, &info) == -1) {
-                    errormsg("lstat failed: %s: %s\n", fpath, strerror(errno));
-                    free((char*)fpath);
-                    continue;
-                }
-                if (S_ISLNK(info.st_mode)) {
-                    //  duped symlinks are always listed if the --symlinks
-                    //  option is set
-                    *kl_pushp(str, filtered_dupes) = fpath;
-                    continue;
-                }
-            }
-            printd("-- %s inode %llu already seen, removing %s from dupes\n",
-                   __func__, (unsigned long long)(info.st_ino), fpath);
-            free((char*)fpath);
-        }
+    if (info->st_size == 0 && flags & F_EXCLUDEEMPTY) {
+        printd("-- %s skipping empty file %s\n", __func__, fpath);
+        return 0;
     }
 
-    // replace files entry at k
-    kh_value(files, k) = filtered_dupes;
+    if (info->st_size < minfilesize
+            || (maxfilesize != -1 && info->st_size > maxfilesize)
+            || info->st_mtime < oldest || info->st_mtime > newest) {
+        printd("-- %s skipping file out of bounds %s\n", __func__, fpath);
+        return 0;
+    }
 
-    kl_destroy(inodev, inodes);
-    kl_destroy(str, dupes);
+    return 1;
 }
 
 /**
- * merge checked_files into files
+ * @return 1 if the file name in the directory dirpath matches some pattern of
+ * list; name is a whole path if dirpath is NULL
  */
-void mergechecked(khash_t(str) *files, khash_t(str) *checked_files)
+int matchglobs(const struct globlist *list, const char *dirpath,
+    const char *name)
 {
-    khint_t checked_k;
-    for (checked_k = kh_begin(checked_files);
-            checked_k != kh_end(checked_files); ++checked_k) {
-        if (!kh_exist(checked_files, checked_k))
-            continue;
+    const char *base = dirpath || !strrchr(name, '/')
+        ? name : strrchr(name, '/') + 1;
+    char *path = NULL;
+    int match = 0;
 
-        const char *sig = kh_key(checked_files, checked_k);
-        int ret;
-        khiter_t k = kh_put(str, files, sig, &ret);
-//        printd("-- %s kh_put sig %s ret %d\n", __func__, fullsig, ret);
-
-        switch (ret) {
-        case -1:
-            errormsg("%s error in kh_put()\n", __func__);
-            continue;
-        case 0:
-            errormsg("-- %s uh oh key already present %s\n", __func__, sig);
-            // there is a file with a (partial) signature equal to the current
-            // full checked signature
-            // TODO fix signature collision
+    for (size_t i = 0; i < list->n && !match; ++i) {
+        if (strchr(list->globs[i], '/') == NULL) {
+            match = fnmatch(list->globs[i], base, 0) == 0;
             continue;
-        default:
-            kh_value(files, k) = kh_value(checked_files, checked_k);
-            break;
         }
+        if (path == NULL)
+            path = dirpath ? joinpath(dirpath, name) : strdup(name);
+        match = fnmatch(list->globs[i], path, 0) == 0;
     }
-    kh_clear(str, checked_files);
+    free(path);
+    return match;
 }
 
-void dumpfiles(khash_t(str) *files)
+/**
+ * tell whether the file name in the directory dirpath passes --include and
+ * --exclude, so that it need not even be stat()ed otherwise
+ */
+int acceptname(const char *dirpath, const char *name)
 {
-    khint_t k;
-    for (k = kh_begin(files); k != kh_end(files); ++k)
-        if (kh_exist(files, k)) {
-            printd("%s files[%s]\n", __func__, kh_key(files, k));
-            klist_t(str) *dupes = kh_value(files, k);
-            kliter_t(str) *p;
-            for (p = kl_begin(dupes); p != kl_end(dupes); p = kl_next(p))
-                printd("\t%s\n", kl_val(p));
-        }
+    if (includes.n > 0 && !matchglobs(&includes, dirpath, name))
+        return 0;
+    return !matchglobs(&excludes, dirpath, name);
 }
 
 /**
- * free files's hash keys (C strings) and values (lists of C strings)
+ * set f to describe the file name in dir with the result info of stat()ing it
  */
-void freefiles(khash_t(str) *files)
+void setfileinfo(struct fileinfo *f, const struct pathdir *dir,
+    const char *name, const struct stat *info)
 {
-    khint_t k;
+    f->dir = dir;
+    f->name = name;
+    f->size = info->st_size;
+    f->dev = info->st_dev;
+    f->ino = info->st_ino;
+    f->mtime = info->st_mtim.tv_sec * 1000000000LL + info->st_mtim.tv_nsec;
+    f->ctime = info->st_ctim.tv_sec * 1000000000LL + info->st_ctim.tv_nsec;
+    f->diskpos = 0;
+}
+
+struct filelist *newfilelist(void)
+{
+    return calloc(1, sizeof(struct filelist));
+}
+
+void pushfile(struct filelist *list, size_t file)
+{
+    if (list->n == list->max) {
+        list->max = list->max ? 2 * list->max : 4;
+        list->files = realloc(list->files, list->max * sizeof *list->files);
+    }
+    list->files[list->n++] = file;
+}
+
+void freefilelist(struct filelist *list)
+{
+    free(list->files);
+    free(list);
+}
+
+/**
+ * @return the index of a copy of f added to filetab
+ */
+size_t pushfiletab(const struct fileinfo *f)
+{
+    if (nfiletab == maxfiletab) {
+        maxfiletab = maxfiletab ? 2 * maxfiletab : 1024;
+        filetab = realloc(filetab, maxfiletab * sizeof *filetab);
+    }
+    filetab[nfiletab] = *f;
+    return nfiletab++;
+}
+
+/**
+ * add f to filetab and to the list of files of its size in sizes
+ */
+void grokfile(const struct fileinfo *f, khash_t(size) *sizes)
+{
+//    printd("-- %s %s\n", __func__, f->name);
+
+    int ret;
+    khiter_t k = kh_put(size, sizes, f->size, &ret);
+//        printd("-- %s kh_put size %lld ret %d\n", __func__, (long long)f->size, ret);
+
+    struct filelist *dupes;
+
+    switch (ret) {
+    case -1:
+        errormsg("%s error in kh_put()\n", __func__);
+        return;
+    case 0:
+//            printd("-- %s key already present\n", __func__);
+        dupes = kh_value(sizes, k);
+        break;
+    default:
+        dupes = newfilelist();
+        kh_value(sizes, k) = dupes;
+        break;
+    }
+
+    pushfile(dupes, pushfiletab(f));
+}
+
+/**
+ * add the file name in dir described by info to spill, as walker id
+ */
+void spillfile(size_t id, const struct pathdir *dir, const char *name,
+    const struct stat *info, int islink)
+{
+    struct fileinfo f;
+    setfileinfo(&f, dir, name, info);
+    struct spillrec r = { f.size, f.dev, f.ino, f.mtime, f.ctime, f.dir,
+                          islink, f.name };
+
+    if (spill_add(spill, id, &r) == -1) {
+        errormsg("could not spill file records: %s\n", strerror(errno));
+        exit(1);
+    }
+    COUNT(nspilled, 1);
+}
+
+/**
+ * remove the temporary files of spill however finddupes exits
+ */
+void removespill(void)
+{
+    if (spill)
+        spill_remove(spill);
+    if (splitspill)
+        spill_remove(splitspill);
+}
+
+/**
+ * remove the temporary files of spill, then die of sig as if it were not
+ * caught
+ */
+void removespillonsignal(int sig)
+{
+    removespill();
+    raise(sig);
+}
+
+/**
+ * order spilled records by size, then by inode, so that the files of a size
+ * and the paths to an inode come together, then by path
+ */
+int cmpspillrec(const struct spillrec *a, const struct spillrec *b)
+{
+    if (a->size != b->size)
+        return a->size < b->size ? -1 : 1;
+    if (a->dev != b->dev)
+        return a->dev < b->dev ? -1 : 1;
+    if (a->ino != b->ino)
+        return a->ino < b->ino ? -1 : 1;
+    if (a->dir == b->dir)
+        return strcmp(a->name, b->name);
+
+    struct fileinfo x = { a->dir, a->name }, y = { b->dir, b->name };
+    char *xpath = filepath(&x), *ypath = filepath(&y);
+    int ret = strcmp(xpath, ypath);
+    free(xpath);
+    free(ypath);
+    return ret;
+}
+
+/**
+ * order records of a size by signature, then as cmpspillrec does
+ */
+int cmpsplitrec(const struct spillrec *a, const struct spillrec *b)
+{
+    int ret = memcmp(a->digest, b->digest, sizeof a->digest);
+    return ret ? ret : cmpspillrec(a, b);
+}
+
+struct dirscan;
+
+/**
+ * a file or a subdirectory found while walking a directory
+ */
+struct walkentry {
+    struct fileinfo file;       // file.name is NULL for a subdirectory
+    int islink;
+    struct dirscan *subdir;
+};
+
+/**
+ * a directory to be scanned by the walkers; its entries are kept in readdir
+ * order so that the files can be fed to the file size table in the same
+ * order a sequential depth-first walk would find them
+ */
+struct dirscan {
+    char *path;
+    const struct pathdir *node; // NULL for the PATH arguments
+    int fd;                     // -1 if not opened yet
+    struct dirscan *parent;
+    dev_t dev;                  // set once the directory is opened
+    ino_t ino;
+    long depth;                 // 0 for the PATH arguments
+    struct walkentry *entries;
+    size_t nentries, maxentries;
+};
+
+/**
+ * the deque of directories waiting to be scanned by one walker; the owner
+ * pushes and pops directories at the tail, other walkers steal them from the
+ * head
+ */
+struct walkqueue {
+    pthread_mutex_t lock;
+    struct dirscan **dirs;
+    size_t head, tail, max;
+};
+
+struct walkpool {
+    struct walkqueue *queues;
+    size_t nqueues;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending;             // directories queued or being scanned
+    unsigned long generation;   // incremented with every queued directory
+    size_t openfds;             // queued directories already opened
+    size_t maxopenfds;
+};
+
+struct walker {
+    struct walkpool *pool;
+    size_t id;                  // index of the walker's own queue
+};
+
+/**
+ * @param path a heap allocated string; the dirscan takes ownership of path
+ */
+struct dirscan *newdirscan(char *path, const struct pathdir *node)
+{
+    struct dirscan *dir = calloc(1, sizeof *dir);
+    dir->path = path;
+    dir->node = node;
+    dir->fd = -1;
+    return dir;
+}
+
+/**
+ * add to dir the file name described by info, or else subdir
+ */
+void addwalkentry(struct dirscan *dir, const char *name,
+    const struct stat *info, int islink, struct dirscan *subdir)
+{
+    if (dir->nentries == dir->maxentries) {
+        dir->maxentries = dir->maxentries ? 2 * dir->maxentries : 16;
+        dir->entries = realloc(dir->entries,
+                               dir->maxentries * sizeof *dir->entries);
+    }
+    struct walkentry *e = &dir->entries[dir->nentries++];
+    if (info)
+        setfileinfo(&e->file, dir->node, name, info);
+    else
+        memset(&e->file, 0, sizeof e->file);
+    e->islink = islink;
+    e->subdir = subdir;
+}
+
+void pushdir(struct walkpool *pool, size_t id, struct dirscan *dir)
+{
+    struct walkqueue *q = &pool->queues[id];
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->max) {
+        if (q->head > 0) {
+            memmove(q->dirs, q->dirs + q->head,
+                    (q->tail - q->head) * sizeof *q->dirs);
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            q->max = q->max ? 2 * q->max : 64;
+            q->dirs = realloc(q->dirs, q->max * sizeof *q->dirs);
+        }
+    }
+    q->dirs[q->tail++] = dir;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->pending;
+    ++pool->generation;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+struct dirscan *popdir(struct walkqueue *q, int steal)
+{
+    struct dirscan *dir = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        dir = steal ? q->dirs[q->head++] : q->dirs[--q->tail];
+        if (q->head == q->tail)
+            q->head = q->tail = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return dir;
+}
+
+/**
+ * queue the subdirectory name of dir for scanning
+ *
+ * While the budget of open descriptors allows it, the subdirectory is opened
+ * right away relative to fd, the descriptor of dir, so that it does not need
+ * to be looked up by its full path later.
+ */
+void addsubdir(struct dirscan *dir, int fd, const char *name,
+    struct walkpool *pool, size_t id)
+{
+    if ((maxdepth != -1 && dir->depth >= maxdepth)
+            || matchglobs(&excludedirs, dir->path, name)) {
+        printd("-- %s pruning directory %s\n", __func__, name);
+        return;
+    }
+
+    struct dirscan *subdir = newdirscan(joinpath(dir->path, name),
+                                       newpathdir(&arenas[id], dir->node,
+                                                  name));
+    subdir->parent = dir;
+    subdir->depth = dir->depth + 1;
+
+    pthread_mutex_lock(&pool->lock);
+    int openit = pool->openfds < pool->maxopenfds;
+    if (openit)
+        ++pool->openfds;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (openit) {
+        subdir->fd = openat(fd, name, O_RDONLY | O_DIRECTORY);
+        COUNT(statsopened, subdir->fd != -1);
+        if (subdir->fd == -1) {
+            errormsg("could not chdir to %s: %s\n", subdir->path,
+                     strerror(errno));
+            pthread_mutex_lock(&pool->lock);
+            --pool->openfds;
+            pthread_mutex_unlock(&pool->lock);
+            free(subdir->path);
+            free(subdir);
+            return;
+        }
+    }
+
+    addwalkentry(dir, NULL, NULL, 0, subdir);
+    pushdir(pool, id, subdir);
+}
+
+/**
+ * tell whether the directory described by info is dir or one of its ancestors
+ */
+int isancestor(const struct dirscan *dir, const struct stat *info)
+{
+    for (; dir; dir = dir->parent)
+        if (dir->dev == info->st_dev && dir->ino == info->st_ino)
+            return 1;
+    return 0;
+}
+
+/**
+ * read the entries of dir, queueing its subdirectories for scanning if
+ * recursing
+ *
+ * Entries are looked up relative to the directory, and the entry type
+ * reported by readdir spares the lookup of directories and special files
+ * altogether when the filesystem provides it.
+ */
+void grokdir(struct dirscan *dir, struct walkpool *pool, size_t id)
+{
+//    printd("-- %s %s\n", __func__, dir->path);
+
+    DIR *cd;
+    struct dirent *dirinfo;
+    struct stat info;
+    int fd = dir->fd;
+
+    if (fd != -1) {
+        pthread_mutex_lock(&pool->lock);
+        --pool->openfds;
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+        COUNT(statsopened, fd != -1);
+    }
+
+    if (fd == -1 || (cd = fdopendir(fd)) == NULL) {
+        errormsg("could not chdir to %s: %s\n", dir->path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    if (fstat(fd, &info) == 0) {
+        dir->dev = info.st_dev;
+        dir->ino = info.st_ino;
+    }
+
+    while ((dirinfo = readdir(cd)) != NULL) {
+        const char *name = dirinfo->d_name;
+        int islink;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        switch (dirinfo->d_type) {
+        case DT_DIR:
+            if (!(flags & F_RECURSE))
+                continue;
+            // with --one-file-system, mount points are left out with all
+            // under them before they take a descriptor
+            if (flags & F_ONEFILESYSTEM) {
+                if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == -1) {
+                    char *fpath = joinpath(dir->path, name);
+                    errormsg("stat failed: %s: %s\n", fpath, strerror(errno));
+                    free(fpath);
+                    continue;
+                }
+                if (info.st_dev != dir->dev) {
+                    printd("-- %s skipping mount point %s\n", __func__, name);
+                    continue;
+                }
+            }
+            addsubdir(dir, fd, name, pool, id);
+            continue;
+        case DT_REG:
+            islink = 0;
+            if (!acceptname(dir->path, name))
+                continue;
+            if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == -1) {
+                char *fpath = joinpath(dir->path, name);
+                errormsg("stat failed: %s: %s\n", fpath, strerror(errno));
+                free(fpath);
+                continue;
+            }
+            break;
+        case DT_LNK:
+        case DT_UNKNOWN:
+            // files of unknown type are stat()ed twice only if symlinks
+            if (dirinfo->d_type == DT_LNK)
+                islink = 1;
+            else if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == -1) {
+                char *fpath = joinpath(dir->path, name);
+                errormsg("lstat failed: %s: %s\n", fpath, strerror(errno));
+                free(fpath);
+                continue;
+            } else
+                islink = S_ISLNK(info.st_mode);
+            if (islink && fstatat(fd, name, &info, 0) == -1) {
+                char *fpath = joinpath(dir->path, name);
+                errormsg("stat failed: %s: %s\n", fpath, strerror(errno));
+                free(fpath);
+                continue;
+            }
+            if (S_ISDIR(info.st_mode)) {
+                if (!(flags & F_RECURSE) || (islink && !(flags & F_FOLLOWLINKS)))
+                    continue;
+                // following a symlink back to an ancestor would never end
+                if (islink && isancestor(dir, &info)) {
+                    printd("-- %s skipping symlink loop %s\n", __func__, name);
+                    continue;
+                }
+                if (flags & F_ONEFILESYSTEM && info.st_dev != dir->dev) {
+                    printd("-- %s skipping mount point %s\n", __func__, name);
+                    continue;
+                }
+                addsubdir(dir, fd, name, pool, id);
+                continue;
+            }
+            break;
+        default: // fifos, sockets and devices
+            printd("-- %s skipping special file %s\n", __func__, name);
+            continue;
+        }
+
+        if ((dirinfo->d_type != DT_REG && !acceptname(dir->path, name))
+                || (flags & F_ONEFILESYSTEM && info.st_dev != dir->dev)
+                || !acceptfile(name, &info, islink))
+            continue;
+        if (spill)
+            spillfile(id, dir->node, name, &info, islink);
+        else
+            addwalkentry(dir, arena_strndup(&arenas[id], name, strlen(name)),
+                         &info, islink, NULL);
+    }
+    closedir(cd);
+}
+
+void *walk(void *arg)
+{
+    struct walker *w = arg;
+    struct walkpool *pool = w->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        unsigned long generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        struct dirscan *dir = popdir(&pool->queues[w->id], 0);
+        for (size_t i = 1; !dir && i < pool->nqueues; ++i)
+            dir = popdir(&pool->queues[(w->id + i) % pool->nqueues], 1);
+
+        if (dir) {
+            grokdir(dir, pool, w->id);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0)
+                pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        // nothing to do: wait until some directory is queued or all are done
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending && generation == pool->generation)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        int done = pool->pending == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (done)
+            break;
+    }
+    return NULL;
+}
+
+/**
+ * @return the descriptors a pass may keep open at once: half the limit of open
+ * descriptors, leaving the rest for the files being read and everything else
+ */
+size_t fdbudget(void)
+{
+    struct rlimit lim;
+
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1)
+        return 64;
+    return lim.rlim_cur == RLIM_INFINITY || lim.rlim_cur > 8192
+        ? 4096 : lim.rlim_cur / 2;
+}
+
+/**
+ * scan the subdirectories of top with up to jobs walker threads, but no more
+ * than MAX_WALKERS nor half the descriptors left by the spill
+ */
+void walkdirs(struct dirscan *top)
+{
+    size_t budget = fdbudget();
+    budget = budget > spillfds ? budget - spillfds : 0;
+    size_t nwalkers = jobs < MAX_WALKERS ? jobs : MAX_WALKERS;
+    if (nwalkers > budget / 2)
+        nwalkers = budget / 2 > 1 ? budget / 2 : 1;
+    struct walkpool pool = { NULL, nwalkers, PTHREAD_MUTEX_INITIALIZER,
+                             PTHREAD_COND_INITIALIZER, 0, 0, 0, 0 };
+    struct walker *walkers = malloc(nwalkers * sizeof *walkers);
+    pthread_t *threads = malloc(nwalkers * sizeof *threads);
+    size_t started;
+
+    // keep the directories queued for scanning open within the budget of
+    // descriptors, leaving room for the directories being read
+    pool.maxopenfds = budget > nwalkers ? budget - nwalkers : 0;
+
+    pool.queues = calloc(nwalkers, sizeof *pool.queues);
+    for (size_t i = 0; i < nwalkers; ++i) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        walkers[i].pool = &pool;
+        walkers[i].id = i;
+    }
+
+    for (size_t i = 0; i < top->nentries; ++i)
+        if (top->entries[i].subdir)
+            pushdir(&pool, i % nwalkers, top->entries[i].subdir);
+
+    // the calling thread is walker 0
+    for (started = 1; started < nwalkers; ++started) {
+        int err = pthread_create(&threads[started], NULL, walk,
+                                 &walkers[started]);
+        if (err) {
+            errormsg("%s could not create thread: %s\n", __func__,
+                     strerror(err));
+            break;
+        }
+    }
+    walk(&walkers[0]);
+    for (size_t i = 1; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < nwalkers; ++i) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].dirs);
+    }
+    free(pool.queues);
+    free(threads);
+    free(walkers);
+}
+
+/**
+ * note the inode of the file at e in inodes. Further paths to an inode are
+ * dropped, unless they are hardlinks and --hardlinks is given, or symlinks
+ * followed with --symlinks; those are recorded in aliases so that the inode
+ * is read just once.
+ *
+ * @return 1 if e is to be kept
+ */
+int keepinode(khash_t(inode) *inodes, struct walkentry *e)
+{
+    struct inodev id = { e->file.ino, e->file.dev };
+    int ret;
+    khiter_t k = kh_put(inode, inodes, id, &ret);
+
+    switch (ret) {
+    case -1:
+        errormsg("%s error in kh_put()\n", __func__);
+        return 1;
+    case 0:
+        break;
+    default:
+        kh_value(inodes, k) = e->file.name;
+        return 1;
+    }
+
+    if (!(flags & F_CONSIDERHARDLINKS) && !e->islink) {
+        printd("-- %s inode %llu already seen, removing %s from dupes\n",
+               __func__, (unsigned long long)e->file.ino, e->file.name);
+        return 0;
+    }
+
+    khiter_t a = kh_put(alias, aliases, (uintptr_t)e->file.name, &ret);
+    if (ret != -1)
+        kh_value(aliases, a) = kh_value(inodes, k);
+    return 1;
+}
+
+/**
+ * feed the files found under top to sizes in depth-first order, except for
+ * further paths to the same inodes, and free the directories
+ */
+void feeddir(struct dirscan *top, khash_t(size) *sizes)
+{
+    khash_t(inode) *inodes = kh_init(inode);
+
+    // the directories being fed and the index of their next entry
+    struct feedframe {
+        struct dirscan *dir;
+        size_t next;
+    } *stack = malloc(16 * sizeof *stack);
+    size_t depth = 0, maxdepth = 16;
+
+    stack[depth].dir = top;
+    stack[depth++].next = 0;
+
+    while (depth > 0) {
+        struct dirscan *dir = stack[depth - 1].dir;
+
+        if (stack[depth - 1].next == dir->nentries) {
+            free(dir->entries);
+            free(dir->path);
+            free(dir);
+            --depth;
+            continue;
+        }
+
+        struct walkentry *e = &dir->entries[stack[depth - 1].next++];
+        if (e->subdir) {
+            if (depth == maxdepth) {
+                maxdepth *= 2;
+                stack = realloc(stack, maxdepth * sizeof *stack);
+            }
+            stack[depth].dir = e->subdir;
+            stack[depth++].next = 0;
+        } else if (keepinode(inodes, e))
+            grokfile(&e->file, sizes);
+    }
+    free(stack);
+    kh_destroy(inode, inodes);
+}
+
+/**
+ * a signature to be computed by the worker pool; err is set if the file could
+ * not be read
+ */
+struct sigjob {
+    struct fileinfo *file;
+    int err;
+    struct signature sig;
+    struct sigjob *primary; // the job reading the same file, or NULL
+    int segmented;          // hashed by hashsegments instead
+    int cached;             // its signature was found in the cache
+};
+
+struct sigpool {
+    struct sigjob *jobs;
+    size_t *order;      // indices of jobs in the order they are taken, or NULL
+    size_t njobs;
+    size_t next;        // index of the next job to be taken by a worker
+    pthread_mutex_t lock;
+    enum sigstage stage;
+    size_t maxopenfds;  // per worker, for the files read through io_uring
+};
+
+/**
+ * a file being hashed through io_uring
+ */
+struct uringfile {
+    struct sigjob *job;
+    int fd;
+    off_t offset;
+    off_t toread;       // bytes left to be hashed
+    off_t dropped;      // see dropconsumed
+    int direct;         // reads bypass the page cache
+    union hashstate state;
+    unsigned char *buf;
+};
+
+struct sigjob *takesigjob(struct sigpool *pool)
+{
+    struct sigjob *job = NULL;
+    size_t taken = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->njobs) {
+        size_t i = pool->next++;
+        ++taken;
+        job = &pool->jobs[pool->order ? pool->order[i] : i];
+        if (job->primary == NULL && !job->segmented && !job->cached)
+            break;
+        job = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    COUNT(progressfiles, taken);
+    showprogress();
+    return job;
+}
+
+/**
+ * set key to the cache key of the file f
+ */
+void getcachekey(const struct fileinfo *f, struct cachekey *key)
+{
+    key->dev = f->dev;
+    key->ino = f->ino;
+    key->size = f->size;
+    key->mtime = f->mtime;
+    key->ctime = f->ctime;
+}
+
+/**
+ * look up the signature of job in the cache
+ *
+ * @return 1 if the signature was found
+ */
+int getcachedsignature(struct sigjob *job, enum sigstage stage)
+{
+    struct cachekey key;
+
+    if (cache == NULL)
+        return 0;
+
+    getcachekey(job->file, &key);
+    if (!cache_get(cache, &key, hashedlen(stage, job->file->size),
+                   job->sig.digest))
+        return 0;
+
+    job->sig.stage = stage;
+    job->sig.size = job->file->size;
+    job->err = 0;
+    return 1;
+}
+
+void runsigjob(struct sigjob *job, enum sigstage stage)
+{
+    char *fpath = filepath(job->file);
+    job->err = getsignature(fpath, stage, job->file->size, &job->sig);
+    free(fpath);
+}
+
+/**
+ * queue the next read of f, or finish its signature if there is nothing left
+ * to read
+ *
+ * @return 1 if a read was queued, 0 if f is done
+ */
+int continueuringfile(struct uring *ring, struct uringfile *f)
+{
+    if (f->toread == 0) {
+        hash->final(&f->state, f->job->sig.digest);
+        f->job->err = 0;
+        close(f->fd);
+        return 0;
+    }
+
+    unsigned len = f->toread < URING_CHUNK_SIZE ? f->toread : URING_CHUNK_SIZE;
+    len = directlen(len, f->direct);
+    if (uring_read(ring, f->fd, f->buf, len, f->offset, f) == -1) {
+        // cannot happen: there is never more than one read per slot
+        errormsg("%s submission queue full\n", __func__);
+        close(f->fd);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * start hashing the file of job
+ *
+ * @param canwait 1 if another file is in flight, so that the file may wait
+ * for its descriptor rather than fail when no descriptor is left
+ * @return 1 if a read was queued, 0 if the file is done already, or -1 if it
+ * could not be opened for lack of descriptors and is to be started again
+ */
+int starturingfile(struct uring *ring, struct uringfile *f,
+    struct sigjob *job, enum sigstage stage, int canwait)
+{
+    f->job = job;
+    job->err = -1;
+    job->sig.stage = stage;
+
+    off_t fsize = job->file->size;
+    job->sig.size = fsize;
+    hash->init(&f->state);
+    // always include file size in the signature
+    hash->update(&f->state, &fsize, sizeof fsize);
+
+    f->offset = 0;
+    f->dropped = 0;
+    f->toread = hashedlen(stage, fsize);
+
+    char *fpath = filepath(job->file);
+    f->fd = openfile(fpath, f->toread, &f->direct);
+    if (f->fd == -1 && canwait && (errno == EMFILE || errno == ENFILE)) {
+        free(fpath);
+        return -1;
+    }
+    if (f->fd == -1) {
+        errormsg("error opening file %s\n", fpath);
+        free(fpath);
+        return 0;
+    }
+    free(fpath);
+
+    return continueuringfile(ring, f);
+}
+
+/**
+ * compute the signatures of the jobs of pool keeping up to queuedepth reads
+ * in flight through io_uring, but no more than maxopenfds files open
+ *
+ * @return 0 on success, -1 if io_uring could not be set up
+ */
+int uringworker(struct sigpool *pool)
+{
+    struct uring ring;
+
+    if (uring_init(&ring, queuedepth) < 0)
+        return -1;
+
+    size_t nslots = (size_t)queuedepth < ring.sq_entries
+        ? (size_t)queuedepth : ring.sq_entries;
+    if (nslots > pool->maxopenfds)
+        nslots = pool->maxopenfds > 1 ? pool->maxopenfds : 1;
+    struct uringfile *slots = calloc(nslots, sizeof *slots);
+    struct uringfile **idle = malloc(nslots * sizeof *idle);
+    size_t nidle = nslots;
+    struct sigjob *job = NULL;  // taken, but left waiting for a descriptor
+
+    for (size_t i = 0; i < nslots; ++i) {
+        // aligned for reads bypassing the page cache
+        posix_memalign((void **)&slots[i].buf, DIRECT_ALIGN, URING_CHUNK_SIZE);
+        idle[i] = &slots[i];
+    }
+
+    for (;;) {
+        while (nidle > 0 && (job || (job = takesigjob(pool)) != NULL)) {
+            int started = starturingfile(&ring, idle[nidle - 1], job,
+                                         pool->stage, nidle < nslots);
+            if (started == -1)
+                break;  // started again once a file in flight is done
+            if (started)
+                --nidle;
+            job = NULL;
+        }
+
+        if (nidle == nslots)
+            break;
+
+        void *data;
+        int res;
+        int err = uring_wait(&ring, &data, &res);
+        if (err) {
+            errormsg("%s io_uring_enter failed: %s\n", __func__,
+                     strerror(-err));
+            exit(1);
+        }
+
+        struct uringfile *f = data;
+        if (res <= 0) {
+            char *fpath = filepath(f->job->file);
+            errormsg("error reading from file %s\n", fpath);
+            free(fpath);
+            close(f->fd);
+            idle[nidle++] = f;
+            continue;
+        }
+
+        // a read bypassing the page cache may go past the bytes to hash
+        if (res > f->toread)
+            res = f->toread;
+        hash->update(&f->state, f->buf, res);
+        countread(res);
+        showprogress();
+        f->offset += res;
+        f->toread -= res;
+        if (!f->direct)
+            dropconsumed(f->fd, &f->dropped, f->offset,
+                         f->toread == 0 ? 2 : 0);
+        if (!continueuringfile(&ring, f))
+            idle[nidle++] = f;
+    }
+
+    for (size_t i = 0; i < nslots; ++i)
+        free(slots[i].buf);
+    free(idle);
+    free(slots);
+    uring_exit(&ring);
+    return 0;
+}
+
+void *sigworker(void *arg)
+{
+    struct sigpool *pool = arg;
+    struct sigjob *job;
+
+    if (io == IO_URING && uringworker(pool) == 0)
+        return NULL;
+
+    while ((job = takesigjob(pool)) != NULL)
+        runsigjob(job, pool->stage);
+    return NULL;
+}
+
+/**
+ * where a file lies on disk, for reading files in an order that spares seeks
+ */
+struct diskpos {
+    dev_t dev;
+    uint64_t pos;       // see getdiskpos
+    size_t job;
+};
+
+static int cmpdiskpos(const void *a, const void *b)
+{
+    const struct diskpos *x = a, *y = b;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->pos != y->pos)
+        return x->pos < y->pos ? -1 : 1;
+    return x->job < y->job ? -1 : x->job > y->job;
+}
+
+/**
+ * @return where the file f lies on disk: the physical offset of its first
+ * extent if FIEMAP tells it and readorder asks for it, its inode otherwise.
+ * The offset is looked up once and kept in f for the later passes.
+ */
+uint64_t getdiskpos(struct fileinfo *f)
+{
+#ifdef FS_IOC_FIEMAP
+    if (readorder != ORDER_PHYSICAL)
+        return f->ino;
+    if (f->diskpos != 0)
+        return f->diskpos;
+
+    f->diskpos = f->ino;
+    char *fpath = filepath(f);
+    int direct;
+    int fd = openfile(fpath, 0, &direct);
+    free(fpath);
+    if (fd == -1)
+        return f->diskpos;
+
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+
+    memset(&fm, 0, sizeof fm);
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0
+            && fm.map.fm_mapped_extents > 0
+            && !(fm.extent.fe_flags & FIEMAP_EXTENT_UNKNOWN)
+            && fm.extent.fe_physical != 0)
+        f->diskpos = fm.extent.fe_physical;
+    close(fd);
+    return f->diskpos;
+#else
+    return f->ino;
+#endif
+}
+
+/**
+ * sort the jobs by where their files lie on disk, or by device alone with
+ * --read-order=none and --device-jobs
+ *
+ * @return the indices of sigjobs in reading order in a heap allocated array,
+ * or NULL to read them in order
+ */
+size_t *orderjobs(struct sigjob *sigjobs, size_t njobs)
+{
+    if ((readorder == ORDER_NONE && !rotationaljobs) || njobs < 2)
+        return NULL;
+
+    struct diskpos *dps = malloc(njobs * sizeof *dps);
+    size_t *order = malloc(njobs * sizeof *order);
+
+    for (size_t i = 0; i < njobs; ++i) {
+        dps[i].dev = sigjobs[i].file->dev;
+        dps[i].pos = 0;
+        dps[i].job = i;
+        if (!sigjobs[i].primary && !sigjobs[i].segmented
+                && !sigjobs[i].cached && readorder != ORDER_NONE)
+            dps[i].pos = getdiskpos(sigjobs[i].file);
+    }
+
+    qsort(dps, njobs, sizeof *dps, cmpdiskpos);
+    for (size_t i = 0; i < njobs; ++i)
+        order[i] = dps[i].job;
+
+    free(dps);
+    return order;
+}
+
+/**
+ * run worker with arg in up to nthreads threads, or in this one if it is 1 or
+ * no thread can be created, and wait for them all
+ */
+void runworkers(void *(*worker)(void *), void *arg, size_t nthreads)
+{
+    if (nthreads <= 1) {
+        worker(arg);
+        return;
+    }
+
+    pthread_t *threads = malloc(nthreads * sizeof *threads);
+    size_t started;
+
+    for (started = 0; started < nthreads; ++started) {
+        int err = pthread_create(&threads[started], NULL, worker, arg);
+        if (err) {
+            errormsg("%s could not create thread: %s\n", __func__,
+                     strerror(err));
+            break;
+        }
+    }
+    if (started == 0) // fall back to running the worker ourselves
+        worker(arg);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+/**
+ * @return 1 if the block device dev is a rotational disk, 0 if it is not, or
+ * -1 if it is not known, as for network and virtual filesystems
+ */
+int isrotational(dev_t dev)
+{
+    int c = EOF;
+#ifdef __linux__
+    // partitions have the queue of their disk
+    static const char *const paths[] = {
+        "/sys/dev/block/%u:%u/queue/rotational",
+        "/sys/dev/block/%u:%u/../queue/rotational",
+    };
+    for (size_t i = 0; i < sizeof paths / sizeof *paths && c == EOF; ++i) {
+        char path[64];
+        snprintf(path, sizeof path, paths[i], major(dev), minor(dev));
+        FILE *file = fopen(path, "r");
+        if (file) {
+            c = fgetc(file);
+            fclose(file);
+        }
+    }
+#endif
+    return c == '1' ? 1 : c == '0' ? 0 : -1;
+}
+
+/**
+ * run the jobs of pool, ordered by device, as a pool of their own for each
+ * device, with the threads --device-jobs gives it, all devices at once
+ */
+void rundevicepools(struct sigpool *pool)
+{
+    struct sigpool *pools = malloc(pool->njobs * sizeof *pools);
+    size_t *nthreads = malloc(pool->njobs * sizeof *nthreads);
+    size_t npools = 0, total = 0;
+
+    for (size_t first = 0, last; first < pool->njobs; first = last) {
+        dev_t dev = pool->jobs[pool->order[first]].file->dev;
+        for (last = first + 1; last < pool->njobs
+                && pool->jobs[pool->order[last]].file->dev == dev; ++last)
+            ;
+
+        size_t n = isrotational(dev) == 1 ? rotationaljobs
+            : otherjobs ? otherjobs : jobs;
+        pools[npools] = (struct sigpool){ pool->jobs, pool->order + first,
+                                          last - first, 0,
+                                          PTHREAD_MUTEX_INITIALIZER,
+                                          pool->stage, 0 };
+        nthreads[npools] = n < last - first ? n : last - first;
+        printd("-- %s device %u:%u %zu jobs %zu threads\n", __func__,
+               major(dev), minor(dev), last - first, nthreads[npools]);
+        total += nthreads[npools++];
+    }
+
+    // share the descriptors among the threads of all devices
+    size_t budget = fdbudget();
+    budget = budget > spillfds ? budget - spillfds : 0;
+    for (size_t i = 0; i < npools; ++i)
+        pools[i].maxopenfds = budget / total;
+
+    pthread_t *threads = malloc(total * sizeof *threads);
+    size_t started = 0;
+
+    for (size_t i = 0; i < npools; ++i) {
+        size_t n;
+        for (n = 0; n < nthreads[i]; ++n) {
+            int err = pthread_create(&threads[started], NULL, sigworker,
+                                     &pools[i]);
+            if (err) {
+                errormsg("%s could not create thread: %s\n", __func__,
+                         strerror(err));
+                break;
+            }
+            ++started;
+        }
+        nthreads[i] = n;
+    }
+    // the devices left without a thread are read by this one
+    for (size_t i = 0; i < npools; ++i)
+        if (nthreads[i] == 0)
+            sigworker(&pools[i]);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(nthreads);
+    free(pools);
+}
+
+/**
+ * a segment of a file hashed on its own, see hashsegments
+ */
+struct segjob {
+    struct sigjob *job;
+    off_t offset, len;
+    int last;           // the last segment of the file
+    int err;
+    unsigned char digest[HASH_LEN];
+};
+
+struct segpool {
+    struct segjob *segs;
+    size_t nsegs;
+    size_t next;        // index of the next segment to be taken by a worker
+    pthread_mutex_t lock;
+};
+
+void *segworker(void *arg)
+{
+    struct segpool *pool = arg;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next < pool->nsegs ? pool->next++ : SIZE_MAX;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == SIZE_MAX)
+            break;
+
+        struct segjob *seg = &pool->segs[i];
+        union hashstate state;
+        char *fpath = filepath(seg->job->file);
+        hash->init(&state);
+        seg->err = hashrange(fpath, seg->offset, seg->len, &state, seg->last);
+        hash->final(&state, seg->digest);
+        free(fpath);
+    }
+    return NULL;
+}
+
+/**
+ * compute the signatures of stage of the segmented jobs among sigjobs as
+ * trees: their segments of segmentsize bytes are hashed on their own, in
+ * parallel, and the signature hashes the file size, the segment size and
+ * the digests of the segments in order
+ */
+void hashsegments(struct sigjob *sigjobs, size_t njobs, enum sigstage stage)
+{
+    size_t nsegs = 0;
+
+    for (size_t i = 0; i < njobs; ++i)
+        if (sigjobs[i].segmented) {
+            off_t len = hashedlen(stage, sigjobs[i].file->size);
+            nsegs += (len + segmentsize - 1) / segmentsize;
+        }
+    if (nsegs == 0)
+        return;
+
+    struct segpool pool = { malloc(nsegs * sizeof *pool.segs), nsegs, 0,
+                            PTHREAD_MUTEX_INITIALIZER };
+    struct segjob *seg = pool.segs;
+
+    for (size_t i = 0; i < njobs; ++i) {
+        if (!sigjobs[i].segmented)
+            continue;
+        off_t len = hashedlen(stage, sigjobs[i].file->size);
+        for (off_t offset = 0; offset < len; offset += segmentsize, ++seg) {
+            seg->job = &sigjobs[i];
+            seg->offset = offset;
+            seg->len = len - offset < segmentsize ? len - offset : segmentsize;
+            seg->last = offset + seg->len == len;
+        }
+    }
+
+    runworkers(segworker, &pool,
+               (size_t)jobs < nsegs ? (size_t)jobs : nsegs);
+
+    for (seg = pool.segs; seg != pool.segs + nsegs; ) {
+        struct sigjob *job = seg->job;
+        union hashstate state;
+        off_t fsize = job->file->size;
+
+        job->err = 0;
+        job->sig.stage = stage;
+        job->sig.size = fsize;
+        hash->init(&state);
+        hash->update(&state, &fsize, sizeof fsize);
+        hash->update(&state, &segmentsize, sizeof segmentsize);
+        for (; seg != pool.segs + nsegs && seg->job == job; ++seg) {
+            job->err |= seg->err;
+            hash->update(&state, seg->digest, HASH_LEN);
+        }
+        hash->final(&state, job->sig.digest);
+    }
+    free(pool.segs);
+}
+
+/**
+ * compute the signatures of all jobs, spreading them over up to jobs threads
+ */
+void runsigjobs(struct sigjob *sigjobs, size_t njobs, enum sigstage stage)
+{
+    size_t nthreads = (size_t)jobs < njobs ? (size_t)jobs : njobs;
+
+    // the cache is looked up before any file is opened, to order them or to
+    // read them; files read further than a segment are hashed segment by
+    // segment once the others are done
+    for (size_t i = 0; i < njobs; ++i) {
+        struct sigjob *job = &sigjobs[i];
+        job->err = -1;
+        job->cached = job->primary == NULL && getcachedsignature(job, stage);
+        job->segmented = job->primary == NULL && !job->cached && segmentsize
+            && hashedlen(stage, job->file->size) > segmentsize;
+    }
+
+    // keep the files read through io_uring open within the budget of
+    // descriptors, less the runs of the spill being merged
+    size_t budget = fdbudget();
+    budget = budget > spillfds ? budget - spillfds : 0;
+
+    struct sigpool pool = { sigjobs, orderjobs(sigjobs, njobs), njobs, 0,
+                            PTHREAD_MUTEX_INITIALIZER, stage,
+                            nthreads > 1 ? budget / nthreads : budget };
+
+    if (rotationaljobs && pool.order)
+        rundevicepools(&pool);
+    else
+        runworkers(sigworker, &pool, nthreads);
+    free(pool.order);
+
+    hashsegments(sigjobs, njobs, stage);
+}
+
+/**
+ * sort the files in dupes into files by the signatures computed for them
+ *
+ * The files with the first new signature are compacted in place at the front
+ * of dupes, which becomes their list; the others go to lists of their own.
+ * dupes is freed if no file is left in it.
+ *
+ * sigjobs points to the signatures of the files in dupes, in list order; on
+ * return it points past them.
+ */
+void checkdupes(struct filelist *dupes, khash_t(sig) *files,
+    struct sigjob **sigjobs)
+{
+    struct signature first;
+    int reused = 0;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < dupes->n; ++i) {
+        size_t file = dupes->files[i];
+        struct sigjob *job = (*sigjobs)++;
+
+        assert(job->file == &filetab[file]);
+        if (job->err)
+            continue;
+        if (cache) {
+            struct cachekey key;
+            getcachekey(job->file, &key);
+            cache_put(cache, &key, hashedlen(job->sig.stage, job->sig.size),
+                      job->sig.digest);
+        }
+
+        if (reused && sigequal(job->sig, first)) {
+            dupes->files[kept++] = file;
+            continue;
+        }
+
+        int ret;
+        khiter_t k = kh_put(sig, files, job->sig, &ret);
+//        printd("-- %s kh_put ret %d\n", __func__, ret);
+
+        struct filelist *newdupes;
+
+        switch (ret) {
+        case -1:
+            errormsg("%s error in kh_put()\n", __func__);
+            continue;
+        case 0:
+//            printd("-- %s key already present\n", __func__);
+            newdupes = kh_value(files, k);
+            break;
+        default:
+            if (!reused) {
+                reused = 1;
+                first = job->sig;
+                kh_value(files, k) = dupes;
+                dupes->files[kept++] = file;
+                continue;
+            }
+            newdupes = newfilelist();
+            kh_value(files, k) = newdupes;
+            break;
+        }
+
+        pushfile(newdupes, file);
+    }
+
+    if (!reused) {
+        freefilelist(dupes);
+        return;
+    }
+    // give back the room of the files that went elsewhere
+    if (kept < dupes->max / 2) {
+        dupes->files = realloc(dupes->files, kept * sizeof *dupes->files);
+        dupes->max = kept;
+    }
+    dupes->n = kept;
+}
+
+/**
+ * files that may be duplicates: they share their size, and their signatures
+ * so far
+ */
+struct candgroup {
+    struct filelist *files;
+    off_t size;
+};
+
+/**
+ * point the jobs of aliases to the jobs of the paths they alias, if any, so
+ * that their files are read once
+ */
+void linkaliases(struct sigjob *sigjobs, size_t njobs)
+{
+    khash_t(index) *index = kh_init(index);
+    int ret;
+
+    for (size_t i = 0; i < njobs; ++i) {
+        khiter_t k = kh_put(index, index, (uintptr_t)sigjobs[i].file->name, &ret);
+        if (ret > 0)
+            kh_value(index, k) = i;
+    }
+
+    for (size_t i = 0; i < njobs; ++i) {
+        khiter_t a = kh_get(alias, aliases, (uintptr_t)sigjobs[i].file->name);
+        if (a == kh_end(aliases))
+            continue;
+        khiter_t k = kh_get(index, index, (uintptr_t)kh_value(aliases, a));
+        if (k != kh_end(index))
+            sigjobs[i].primary = &sigjobs[kh_value(index, k)];
+    }
+
+    kh_destroy(index, index);
+}
+
+/**
+ * compute the signatures of the given stage for the files of all groups with
+ * the worker pool, then sort them into files with checkdupes
+ */
+void checkgroups(struct candgroup *groups, size_t ngroups, khash_t(sig) *files,
+    enum sigstage stage)
+{
+    size_t njobs = 0;
+
+    for (size_t i = 0; i < ngroups; ++i)
+        njobs += groups[i].files->n;
+
+    struct sigjob *sigjobs = malloc(njobs * sizeof *sigjobs);
+    struct sigjob *job = sigjobs;
+
+    for (size_t i = 0; i < ngroups; ++i) {
+        for (size_t j = 0; j < groups[i].files->n; ++j) {
+            job->file = &filetab[groups[i].files->files[j]];
+            job++->primary = NULL;
+        }
+    }
+
+    if (kh_size(aliases) > 0)
+        linkaliases(sigjobs, njobs);
+
+    runsigjobs(sigjobs, njobs, stage);
+
+    for (job = sigjobs; job != sigjobs + njobs; ++job)
+        if (job->primary) {
+            job->err = job->primary->err;
+            job->sig = job->primary->sig;
+        }
+
+    job = sigjobs;
+    for (size_t i = 0; i < ngroups; ++i)
+        checkdupes(groups[i].files, files, &job);
+    assert(job == sigjobs + njobs);
+
+    free(sigjobs);
+}
+
+/**
+ * a file of a group being compared byte by byte
+ */
+struct cmpfile {
+    size_t file;        // index into filetab
+    int fd;             // -1 if the file is reopened for every chunk
+    int direct;         // reads of fd bypass the page cache
+    off_t dropped;      // see dropconsumed
+    size_t set;         // files with the same contents so far share a set
+    int active;         // still compared against the other files of its set
+    int eof;            // the whole file has been read
+};
+
+/**
+ * a chunk read in the current round, the reference for the files of oldset
+ * that go to newset
+ */
+struct cmpchunk {
+    size_t oldset;
+    size_t newset;
+    size_t len;
+    unsigned char *buf;             // NULL past MAX_COMPARE_BUFFERS, then
+    unsigned char digest[HASH_LEN]; // the chunk is known by its digest
+    size_t rep;                     // and read again from this file
+};
+
+/**
+ * the groups of files to be compared by the worker pool; each group is split
+ * into the heap allocated array sets[i] of nsets[i] lists of identical files
+ */
+struct cmppool {
+    struct candgroup *groups;
+    size_t ngroups;
+    size_t next;        // index of the next group to be taken by a worker
+    pthread_mutex_t lock;
+    size_t maxopenfds;  // per worker
+    struct filelist ***sets;
+    size_t *nsets;
+};
+
+/**
+ * read up to len bytes at offset of f into buf
+ *
+ * @return the number of bytes read, less than len only at end of file, or -1
+ * on error
+ */
+ssize_t readcmpfile(struct cmpfile *f, unsigned char *buf, size_t len,
+    off_t offset)
+{
+    int fd = f->fd, direct = f->direct;
+    size_t done = 0;
+
+    if (fd == -1) {
+        char *fpath = filepath(&filetab[f->file]);
+        fd = openfile(fpath, filetab[f->file].size, &direct);
+        if (fd == -1)
+            errormsg("error opening file %s\n", fpath);
+        free(fpath);
+        if (fd == -1)
+            return -1;
+    }
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            char *fpath = filepath(&filetab[f->file]);
+            errormsg("error reading from file %s\n", fpath);
+            free(fpath);
+            done = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        done += n;
+        // a short read bypassing the page cache is at the end of the file
+        if (direct)
+            break;
+    }
+    if (done != (size_t)-1) {
+        countread(done);
+        if (!direct)
+            dropconsumed(fd, &f->dropped, offset + done, done < len ? 2 : 0);
+    }
+    showprogress();
+    if (fd != f->fd)
+        close(fd);
+    return done;
+}
+
+/**
+ * put the digest of the len bytes of buf in digest
+ */
+static void hashchunk(const unsigned char *buf, size_t len,
+    unsigned char digest[HASH_LEN])
+{
+    union hashstate state;
+    hash->init(&state);
+    hash->update(&state, buf, len);
+    hash->final(&state, digest);
+}
+
+/**
+ * split group into lists of files with identical contents, reading all files
+ * in lockstep one chunk at a time and dropping every file from further reads
+ * as soon as no other file matches it; at most maxopenfds files are kept open,
+ * the others are reopened for every chunk.  Past MAX_COMPARE_BUFFERS distinct
+ * chunks in a round, further ones are known by their digest and read again to
+ * be compared byte for byte when a digest matches.  Files that cannot be read are
+ * dropped.  Aliases of files in group are not read but put in the sets of the
+ * files they alias, as linkaliases does for signatures.  The list order of
+ * files is preserved within each set.
+ *
+ * @return a heap allocated array of *nsets lists, the first of which reuses
+ * group, or else group is freed
+ */
+struct filelist **comparegroup(struct filelist *group, size_t maxopenfds,
+    size_t *nsets)
+{
+    size_t nfiles = group->n;
+    struct cmpfile *files = malloc(nfiles * sizeof *files);
+    size_t *setsizes = calloc(nfiles, sizeof *setsizes);
+    struct cmpchunk *chunks = malloc(nfiles * sizeof *chunks);
+    unsigned char **bufs = malloc(nfiles * sizeof *bufs);
+    unsigned char *again = NULL;        // a chunk read again
+    // the index in files of each file of group, or SIZE_MAX, and the index
+    // in group of the file each aliases, or SIZE_MAX
+    size_t *cmpof = malloc(nfiles * sizeof *cmpof);
+    size_t *aliasof = malloc(nfiles * sizeof *aliasof);
+    size_t nbufs = 0;
+    size_t nopen = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < group->n; ++i)
+        aliasof[i] = SIZE_MAX;
+    if (kh_size(aliases) > 0) {
+        khash_t(index) *index = kh_init(index);
+        int ret;
+
+        for (size_t i = 0; i < group->n; ++i) {
+            const char *name = filetab[group->files[i]].name;
+            khiter_t k = kh_put(index, index, (uintptr_t)name, &ret);
+            if (ret > 0)
+                kh_value(index, k) = i;
+        }
+        for (size_t i = 0; i < group->n; ++i) {
+            const char *name = filetab[group->files[i]].name;
+            khiter_t a = kh_get(alias, aliases, (uintptr_t)name);
+            if (a == kh_end(aliases))
+                continue;
+            khiter_t k = kh_get(index, index, (uintptr_t)kh_value(aliases, a));
+            if (k != kh_end(index))
+                aliasof[i] = kh_value(index, k);
+        }
+        kh_destroy(index, index);
+    }
+
+    for (size_t i = 0; i < group->n; ++i) {
+        struct cmpfile *f = &files[n];
+        cmpof[i] = SIZE_MAX;
+        if (aliasof[i] != SIZE_MAX)
+            continue;
+        f->file = group->files[i];
+        f->fd = -1;
+        f->direct = 0;
+        f->dropped = 0;
+        if (nopen < maxopenfds) {
+            char *fpath = filepath(&filetab[f->file]);
+            f->fd = openfile(fpath, filetab[f->file].size, &f->direct);
+            if (f->fd == -1)
+                errormsg("error opening file %s\n", fpath);
+            free(fpath);
+            if (f->fd == -1)
+                continue;
+            ++nopen;
+        }
+        f->set = 0;
+        f->active = 1;
+        f->eof = 0;
+        cmpof[i] = n++;
+    }
+    // aliases are only read through the files they alias
+    for (size_t i = 0; i < group->n; ++i)
+        if (aliasof[i] != SIZE_MAX)
+            cmpof[i] = cmpof[aliasof[i]];
+    nfiles = n;
+    setsizes[0] = nfiles;
+    *nsets = nfiles > 0;
+
+    for (off_t offset = 0; ; offset += COMPARE_CHUNK_SIZE) {
+        size_t nchunks = 0, nkept = 0;
+
+        for (size_t i = 0; i < nfiles; ++i) {
+            struct cmpfile *f = &files[i];
+            if (!f->active)
+                continue;
+
+            // aligned for reads bypassing the page cache
+            if (nbufs == 0)
+                posix_memalign((void **)&bufs[nbufs++], DIRECT_ALIGN,
+                               COMPARE_CHUNK_SIZE);
+            unsigned char *buf = bufs[nbufs - 1];
+
+            ssize_t len = readcmpfile(f, buf, COMPARE_CHUNK_SIZE, offset);
+            if (len == -1) {
+                --setsizes[f->set];
+                f->set = SIZE_MAX;
+                f->active = 0;
+                if (f->fd != -1)
+                    close(f->fd);
+                f->fd = -1;
+                continue;
+            }
+            f->eof = len < COMPARE_CHUNK_SIZE;
+
+            // look for a file of the same set with the same chunk
+            unsigned char digest[HASH_LEN];
+            int hashed = 0;
+            size_t c;
+            for (c = 0; c < nchunks; ++c) {
+                struct cmpchunk *k = &chunks[c];
+                if (k->oldset != f->set || k->len != (size_t)len)
+                    continue;
+                if (k->buf) {
+                    if (memcmp(k->buf, buf, len) == 0)
+                        break;
+                    continue;
+                }
+                if (!hashed) {
+                    hashchunk(buf, len, digest);
+                    hashed = 1;
+                }
+                if (memcmp(k->digest, digest, HASH_LEN) != 0)
+                    continue;
+                if (again == NULL)
+                    posix_memalign((void **)&again, DIRECT_ALIGN,
+                                   COMPARE_CHUNK_SIZE);
+                if (readcmpfile(&files[k->rep], again, COMPARE_CHUNK_SIZE,
+                                offset) == len
+                        && memcmp(again, buf, len) == 0)
+                    break;
+            }
+            if (c == nchunks) {
+                // the first new set split off from f->set keeps its number
+                size_t c2;
+                for (c2 = 0; c2 < nchunks; ++c2)
+                    if (chunks[c2].oldset == f->set)
+                        break;
+                struct cmpchunk *k = &chunks[nchunks++];
+                k->oldset = f->set;
+                k->newset = c2 == nchunks - 1 ? f->set : (*nsets)++;
+                k->len = len;
+                if (nkept < MAX_COMPARE_BUFFERS) {
+                    k->buf = buf;
+                    --nbufs;
+                    ++nkept;
+                } else {
+                    if (!hashed)
+                        hashchunk(buf, len, digest);
+                    memcpy(k->digest, digest, HASH_LEN);
+                    k->buf = NULL;
+                    k->rep = i;
+                }
+            }
+            --setsizes[f->set];
+            f->set = chunks[c].newset;
+            ++setsizes[f->set];
+        }
+
+        for (size_t c = 0; c < nchunks; ++c)
+            if (chunks[c].buf)
+                bufs[nbufs++] = chunks[c].buf;
+
+        // files alone in their set, or read to the end, are done
+        int active = 0;
+        for (size_t i = 0; i < nfiles; ++i) {
+            struct cmpfile *f = &files[i];
+            if (f->active && (f->eof || setsizes[f->set] < 2)) {
+                f->active = 0;
+                if (f->fd != -1)
+                    close(f->fd);
+                f->fd = -1;
+            }
+            active |= f->active;
+        }
+        if (!active)
+            break;
+    }
+
+    // the files of the first set are compacted in place in group
+    struct filelist **sets = malloc((*nsets > 0 ? *nsets : 1) * sizeof *sets);
+    size_t ngroup = group->n;
+    sets[0] = group;
+    group->n = 0;
+    for (size_t i = 1; i < *nsets; ++i)
+        sets[i] = newfilelist();
+    for (size_t i = 0; i < ngroup; ++i)
+        if (cmpof[i] != SIZE_MAX && files[cmpof[i]].set != SIZE_MAX)
+            pushfile(sets[files[cmpof[i]].set], group->files[i]);
+
+    // sets left empty by read errors are dropped
+    n = 0;
+    for (size_t i = 0; i < *nsets; ++i)
+        if (sets[i]->n > 0)
+            sets[n++] = sets[i];
+        else
+            freefilelist(sets[i]);
+    if (*nsets == 0)
+        freefilelist(group);
+    *nsets = n;
+
+    for (size_t i = 0; i < nbufs; ++i)
+        free(bufs[i]);
+    free(bufs);
+    free(again);
+    free(chunks);
+    free(setsizes);
+    free(aliasof);
+    free(cmpof);
+    free(files);
+    return sets;
+}
+
+void *cmpworker(void *arg)
+{
+    struct cmppool *pool = arg;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next < pool->ngroups ? pool->next++ : SIZE_MAX;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == SIZE_MAX)
+            break;
+
+        size_t n = pool->groups[i].files->n;
+        pool->sets[i] = comparegroup(pool->groups[i].files, pool->maxopenfds,
+                                     &pool->nsets[i]);
+        COUNT(progressfiles, n);
+    }
+    return NULL;
+}
+
+/**
+ * split all groups into sets of identical files by comparing their contents
+ * with the worker pool, then put the sets into files keyed by serial number
+ */
+void comparegroups(struct candgroup *groups, size_t ngroups,
+    khash_t(sig) *files)
+{
+    size_t nthreads = (size_t)jobs < ngroups ? (size_t)jobs : ngroups;
+    struct cmppool pool = { groups, ngroups, 0, PTHREAD_MUTEX_INITIALIZER,
+                            64, NULL, NULL };
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    // keep the files being compared open within the budget of descriptors,
+    // less the runs of the spill being merged
+    pool.maxopenfds = fdbudget();
+    pool.maxopenfds = pool.maxopenfds > spillfds
+        ? (pool.maxopenfds - spillfds) / nthreads : 0;
+
+    pool.sets = malloc(ngroups * sizeof *pool.sets);
+    pool.nsets = malloc(ngroups * sizeof *pool.nsets);
+
+    pthread_t *threads = malloc(nthreads * sizeof *threads);
+    size_t started;
+
+    for (started = 1; started < nthreads; ++started) {
+        int err = pthread_create(&threads[started], NULL, cmpworker, &pool);
+        if (err) {
+            errormsg("%s could not create thread: %s\n", __func__,
+                     strerror(err));
+            break;
+        }
+    }
+    cmpworker(&pool);
+    for (size_t i = 1; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    struct signature sig = { { 0 }, SIG_BYTES, 0 };
+    size_t serial = 0;
+
+    for (size_t i = 0; i < ngroups; ++i) {
+        sig.size = groups[i].size;
+        for (size_t j = 0; j < pool.nsets[i]; ++j) {
+            int ret;
+            ++serial;
+            memcpy(sig.digest, &serial, sizeof serial);
+            khiter_t k = kh_put(sig, files, sig, &ret);
+            if (ret == -1) {
+                errormsg("%s error in kh_put()\n", __func__);
+                freefilelist(pool.sets[i][j]);
+                continue;
+            }
+            kh_value(files, k) = pool.sets[i][j];
+        }
+        free(pool.sets[i]);
+    }
+
+    free(threads);
+    free(pool.nsets);
+    free(pool.sets);
+}
+
+/**
+ * remove the entries of sizes holding more than one file and return them in
+ * a heap allocated array
+ */
+struct candgroup *takesizegroups(khash_t(size) *sizes, size_t *ngroups)
+{
+    struct candgroup *groups = malloc(kh_size(sizes) * sizeof *groups);
+    khint_t k;
+
+    *ngroups = 0;
+    for (k = kh_begin(sizes); k != kh_end(sizes); ++k)
+        if (kh_exist(sizes, k) && kh_value(sizes, k)->n > 1) {
+            groups[*ngroups].files = kh_value(sizes, k);
+            groups[(*ngroups)++].size = kh_key(sizes, k);
+            kh_del(size, sizes, k);
+        }
+    return groups;
+}
+
+/**
+ * remove the entries of files holding more than one file larger than minsize
+ * and return them in a heap allocated array. Smaller files were hashed whole
+ * already, so their entries are final.
+ */
+struct candgroup *takesiggroups(khash_t(sig) *files, off_t minsize,
+    size_t *ngroups)
+{
+    struct candgroup *groups = malloc(kh_size(files) * sizeof *groups);
+    khint_t k;
+
+    *ngroups = 0;
+    for (k = kh_begin(files); k != kh_end(files); ++k)
+        if (kh_exist(files, k) && kh_value(files, k)->n > 1
+                && kh_key(files, k).size > minsize) {
+            groups[*ngroups].files = kh_value(files, k);
+            groups[(*ngroups)++].size = kh_key(files, k).size;
+            kh_del(sig, files, k);
+        }
+    return groups;
+}
+
+/**
+ * @return the number of bytes of the files in groups hashed by stage
+ */
+unsigned long long countbytes(const struct candgroup *groups, size_t ngroups,
+    enum sigstage stage)
+{
+    unsigned long long n = 0;
+    for (size_t i = 0; i < ngroups; ++i)
+        n += (unsigned long long)hashedlen(stage, groups[i].size)
+            * groups[i].files->n;
+    return n;
+}
+
+/**
+ * @return the number of files larger than minsize in groups
+ */
+size_t countfiles(const struct candgroup *groups, size_t ngroups,
+    off_t minsize)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < ngroups; ++i)
+        if (groups[i].size > minsize)
+            n += groups[i].files->n;
+    return n;
+}
+
+/**
+ * tell whether hashing stage is likely to pay off for groups: assuming it
+ * leaves alone the same share rate of the files as the previous stage, it
+ * should spare the full pass more bytes than it reads. Files no longer than
+ * the stage are read whole just once either way.
+ *
+ * A stage that left no file alone may still have stopped short of a common
+ * header, so at least 1/STAGE_GROWTH is assumed: stages reading a small part
+ * of the files always run, which adds little to the full pass as the ladder
+ * grows geometrically.
+ */
+int worthstage(const struct candgroup *groups, size_t ngroups,
+    enum sigstage stage, double rate)
+{
+    double cost = 0, saving = 0;
+
+    if (rate < 1.0 / STAGE_GROWTH)
+        rate = 1.0 / STAGE_GROWTH;
+
+    for (size_t i = 0; i < ngroups; ++i) {
+        double n = groups[i].files->n;
+        off_t len = stagesizes[stage];
+        if (groups[i].size <= len)
+            continue;
+        cost += n * len;
+        saving += rate * n * (groups[i].size - len);
+    }
+    return saving > cost;
+}
+
+void dumpdupes(const struct filelist *dupes)
+{
+    for (size_t i = 0; i < dupes->n; ++i)
+        printd("\t%s\n", filetab[dupes->files[i]].name);
+}
+
+void dumpfiles(khash_t(size) *sizes, khash_t(sig) *files)
+{
+    khint_t k;
+    for (k = kh_begin(sizes); k != kh_end(sizes); ++k)
+        if (kh_exist(sizes, k)) {
+            printd("%s sizes[%lld]\n", __func__,
+                   (long long)kh_key(sizes, k));
+            dumpdupes(kh_value(sizes, k));
+        }
+    for (k = kh_begin(files); k != kh_end(files); ++k)
+        if (kh_exist(files, k)) {
+            printd("%s files[%s]\n", __func__,
+                   sigtostr(&kh_key(files, k), (char[2*HASH_LEN + 1]){ 0 }));
+            dumpdupes(kh_value(files, k));
+        }
+}
+
+/**
+ * free the hash values (lists of files) of sizes and files
+ */
+void freefiles(khash_t(size) *sizes, khash_t(sig) *files)
+{
+    khint_t k;
+    // explicitly freeing memory takes 10-20% CPU time.
+    for (k = kh_begin(sizes); k != kh_end(sizes); ++k)
+        if (kh_exist(sizes, k))
+            freefilelist(kh_value(sizes, k));
+    for (k = kh_begin(files); k != kh_end(files); ++k)
+        if (kh_exist(files, k))
+            freefilelist(kh_value(files, k));
+}
+
+void putverbatim(const char *str, size_t len)
+{
+    fwrite(str, 1, len, stdout);
+}
+
+/**
+ * print the set dupes with its metadata in the format chosen with --format
+ *
+ * @param sig the signature of the set, or NULL if only its size is known
+ */
+void printset(const struct filelist *dupes, const struct signature *sig)
+{
+    const struct fileinfo *f = &filetab[dupes->files[0]];
+    char digest[2*HASH_LEN + 1] = "-";
+    size_t first = flags & F_OMITFIRST && dupes->n > 1;
+
+    ++nsets;
+    if (sig && sig->stage != SIG_BYTES)
+        sigtostr(sig, digest);
+
+    if (format == FORMAT_NUL) {
+        for (size_t i = first; i < dupes->n; ++i) {
+            f = &filetab[dupes->files[i]];
+            printf("%llu %lld %s %llu %llu ", nsets, (long long)f->size,
+                   digest, (unsigned long long)f->dev,
+                   (unsigned long long)f->ino);
+            putfilepath(f, putstr);
+            putchar('\0');
+        }
+        return;
+    }
+
+    if (format == FORMAT_JSON)
+        fputs(nsets > 1 ? ",\n" : "\n", stdout);
+    printf("{\"id\":%llu,\"size\":%lld,\"digest\":", nsets,
+           (long long)f->size);
+    if (digest[0] == '-')
+        fputs("null", stdout);
+    else
+        printf("\"%s\"", digest);
+    fputs(",\"files\":[", stdout);
+    for (size_t i = first; i < dupes->n; ++i) {
+        f = &filetab[dupes->files[i]];
+        fputs(i > first ? ",{\"path\":\"" : "{\"path\":\"", stdout);
+        putfilepath(f, putjsonstr);
+        // the path cannot be told from others by the replacement characters
+        if (!isutf8path(f)) {
+            fputs("\",\"path_b64\":\"", stdout);
+            putbase64path(f);
+        }
+        printf("\",\"dev\":%llu,\"ino\":%llu}", (unsigned long long)f->dev,
+               (unsigned long long)f->ino);
+    }
+    fputs("]}", stdout);
+    if (format == FORMAT_JSONL)
+        putchar('\n');
+}
+
+/**
+ * start a run of pass over filesin files in ngroups groups; no other thread
+ * may be running
+ */
+void startpass(struct passstats *pass, size_t filesin, size_t ngroups)
+{
+    if (!statspath)
+        return;
+    ++pass->runs;
+    pass->filesin += filesin;
+    pass->groups += ngroups;
+    statsbytes = statsopened = statserrors = 0;
+    pass->startwall = wallclock();
+    pass->startcpu = cpuclock();
+}
+
+/**
+ * end the run of pass started last, which left filesout files
+ */
+void endpass(struct passstats *pass, size_t filesout)
+{
+    if (!statspath)
+        return;
+    pass->wall += wallclock() - pass->startwall;
+    pass->cpu += cpuclock() - pass->startcpu;
+    pass->filesout += filesout;
+    pass->bytes += statsbytes;
+    pass->opened += statsopened;
+    pass->errors += statserrors;
+}
+
+/**
+ * @return the number of files in files sharing a signature of stage with
+ * some other file
+ */
+size_t countdupes(khash_t(sig) *files, enum sigstage stage)
+{
+    size_t n = 0;
+    if (!statspath)
+        return 0;
+    for (khint_t k = kh_begin(files); k != kh_end(files); ++k)
+        if (kh_exist(files, k) && kh_key(files, k).stage == stage
+                && kh_value(files, k)->n > 1)
+            n += kh_value(files, k)->n;
+    return n;
+}
+
+static int cmpinodev(const void *a, const void *b)
+{
+    const struct inodev *x = a, *y = b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/**
+ * add the set of duplicates dupes to the totals of --stats
+ */
+void countset(const struct filelist *dupes)
+{
+    if (!statspath || dupes->n < 2)
+        return;
+    off_t size = filetab[dupes->files[0]].size;
+    struct inodev *ids = malloc(dupes->n * sizeof *ids);
+    size_t ninodes = 0;
+
+    for (size_t i = 0; i < dupes->n; ++i) {
+        ids[i].dev = filetab[dupes->files[i]].dev;
+        ids[i].ino = filetab[dupes->files[i]].ino;
+    }
+    qsort(ids, dupes->n, sizeof *ids, cmpinodev);
+    for (size_t i = 0; i < dupes->n; ++i)
+        if (i == 0 || cmpinodev(&ids[i - 1], &ids[i]) != 0)
+            ++ninodes;
+    free(ids);
+
+    ++statssets;
+    statsfiles += dupes->n;
+    statsdupbytes += (unsigned long long)size * dupes->n;
+    statsreclaim += (unsigned long long)size * (ninodes - 1);
+}
+
+/**
+ * print dupes if it is a set of duplicates, or with --unique if it is a
+ * single file
+ *
+ * @param sig the signature of the set, or NULL if only its size is known
+ */
+void printdupes(const struct filelist *dupes, const struct signature *sig)
+{
+    if (dupes->n == 0 || (dupes->n == 1) != !!(flags & F_UNIQUE))
+        return;
+    if (format != FORMAT_TEXT) {
+        printset(dupes, sig);
+        return;
+    }
+    if (dupes->n == 1) {
+        putfilepath(&filetab[dupes->files[0]], putstr);
+        putverbatim(sep, seplen);
+    } else {
+        for (size_t i = flags & F_OMITFIRST ? 1 : 0; i < dupes->n; ++i) {
+            putfilepath(&filetab[dupes->files[i]], putstr);
+            if (i + 1 < dupes->n)
+                putverbatim(sep, seplen);
+        }
+        putverbatim(setsep, setseplen);
+    }
+}
+
+void printfiles(khash_t(size) *sizes, khash_t(sig) *files)
+{
+    khint_t k;
+    for (k = kh_begin(sizes); k != kh_end(sizes); ++k)
+        if (kh_exist(sizes, k))
+            printdupes(kh_value(sizes, k), NULL);
     for (k = kh_begin(files); k != kh_end(files); ++k)
-        // explicitly freeing memory takes 10-20% CPU time.
         if (kh_exist(files, k)) {
-            klist_t(str) *dupes = kh_value(files, k);
-            kliter_t(str) *p;
-            for (p = kl_begin(dupes); p != kl_end(dupes); p = kl_next(p))
-                free((char*)kl_val(p));
-            kl_destroy(str, dupes);
-            free((char*)kh_key(files, k));
+            countset(kh_value(files, k));
+            printdupes(kh_value(files, k), &kh_key(files, k));
         }
 }
 
-void putverbatim(const char *str, size_t len)
+/**
+ * sort the files of groups into sets of identical files in files, and free
+ * groups
+ *
+ * @param first the first stage to run, the files of each group sharing their
+ * signatures of the stages before
+ */
+void findsets(struct candgroup *groups, size_t ngroups, khash_t(sig) *files,
+    size_t first)
+{
+    // second pass: get signatures of ever longer prefixes of the files sharing
+    // their size with some other file. The first stage always runs, later
+    // ones only if the share of files the last one left alone makes them
+    // worth it.
+    double rate = 1;
+    for (size_t stage = first; stage < nstages && ngroups > 0; ++stage) {
+        if (stage > 0 && !worthstage(groups, ngroups, stage, rate))
+            continue;
+        size_t before = countfiles(groups, ngroups, stagesizes[stage]);
+        size_t nfiles = countfiles(groups, ngroups, -1);
+        startprogress("hashing first", stagesizes[stage], nfiles,
+                      countbytes(groups, ngroups, stage));
+        startpass(&stagestats[stage], nfiles, ngroups);
+        checkgroups(groups, ngroups, files, stage);
+        endpass(&stagestats[stage], countdupes(files, stage));
+        endprogress();
+        free(groups);
+        groups = takesiggroups(files, stagesizes[stage], &ngroups);
+        if (before > 0)
+            rate = 1 - (double)countfiles(groups, ngroups, 0) / before;
+        printd("-- stage %zu left alone %.0f%% of the files\n", stage,
+               100 * rate);
+    }
+
+//    printd("-- after second pass: prefix signatures\n");
+//    dumpfiles(sizes, files);
+
+    // third pass: get full contents signature or compare contents of the
+    // files not hashed whole yet
+    enum sigstage last = compare == COMPARE_BYTES ? SIG_BYTES : SIG_FULL;
+    if (ngroups > 0) {
+        size_t nfiles = countfiles(groups, ngroups, -1);
+        startprogress(compare == COMPARE_BYTES ? "comparing" : "hashing", 0,
+                      nfiles, countbytes(groups, ngroups, SIG_FULL));
+        startpass(&stagestats[last], nfiles, ngroups);
+    }
+    if (compare == COMPARE_BYTES)
+        comparegroups(groups, ngroups, files);
+    else
+        checkgroups(groups, ngroups, files, SIG_FULL);
+    if (ngroups > 0) {
+        endpass(&stagestats[last], countdupes(files, last));
+        endprogress();
+    }
+    free(groups);
+
+//    printd("-- after third pass: full signature\n");
+//    dumpfiles(sizes, files);
+}
+
+/**
+ * sort the files of the groups of window into sets, print them and free them
+ * along with window
+ *
+ * @param files an empty table to hold the sets, emptied again
+ * @param first the first stage to run, as with findsets
+ */
+void streamwindow(struct candgroup *window, size_t n, khash_t(sig) *files,
+    size_t first)
 {
-    while(len--)
-        putchar(*str++);
+    findsets(window, n, files, first);
+    for (khint_t k = kh_begin(files); k != kh_end(files); ++k)
+        if (kh_exist(files, k)) {
+            countset(kh_value(files, k));
+            printdupes(kh_value(files, k), &kh_key(files, k));
+            freefilelist(kh_value(files, k));
+        }
+    kh_clear(sig, files);
+    fflush(stdout);
 }
 
-void printfiles(khash_t(str) *files)
+static int cmpcandgroup(const void *a, const void *b)
 {
-    khint_t k;
-    for (k = kh_begin(files); k != kh_end(files); ++k) {
-        if (!kh_exist(files, k))
-            continue;
-        klist_t(str) *dupes = kh_value(files, k);
-        if (kl_begin(dupes) == kl_end(dupes))
+    const struct candgroup *x = a, *y = b;
+    return x->size < y->size ? -1 : x->size > y->size;
+}
+
+/**
+ * print the files alone in their size in sizes right away, then sort the
+ * files of groups into sets a few groups at a time, smallest files first,
+ * printing the sets as soon as they are known; free groups and the sets
+ *
+ * @param files an empty table to hold the sets of the groups at hand
+ */
+void streamfiles(struct candgroup *groups, size_t ngroups,
+    khash_t(size) *sizes, khash_t(sig) *files)
+{
+    printfiles(sizes, files);
+    fflush(stdout);
+
+    qsort(groups, ngroups, sizeof *groups, cmpcandgroup);
+    for (size_t first = 0, last; first < ngroups; first = last) {
+        size_t nfiles = 0;
+        off_t bytes = 0;
+
+        for (last = first; last < ngroups && (last == first
+                || (nfiles < STREAM_FILES && bytes < STREAM_BYTES)); ++last) {
+            nfiles += groups[last].files->n;
+            bytes += groups[last].size * groups[last].files->n;
+        }
+
+        struct candgroup *window = malloc((last - first) * sizeof *window);
+        memcpy(window, groups + first, (last - first) * sizeof *window);
+        streamwindow(window, last - first, files, 0);
+    }
+    free(groups);
+}
+
+/**
+ * add the file of r to group, a new list if NULL, keeping its name in names;
+ * a further path to the inode of the file added last, last, is an alias of
+ * the first path to it if that is in group too, as with keepinode
+ *
+ * @return group
+ */
+struct filelist *pushspillrec(struct filelist *group, const struct spillrec *r,
+    struct arena *names, struct inodev *last)
+{
+    int alias = group && last->dev == r->dev && last->ino == r->ino;
+    struct fileinfo f = { r->dir, arena_strndup(names, r->name,
+                                                strlen(r->name)),
+                          r->size, r->dev, r->ino, r->mtime, r->ctime };
+
+    if (alias) {
+        // to the first path to the inode, which comes right before
+        const char *first = filetab[group->files[group->n - 1]].name;
+        khiter_t a = kh_get(alias, aliases, (uintptr_t)first);
+        if (a != kh_end(aliases))
+            first = kh_value(aliases, a);
+        int absent;
+        a = kh_put(alias, aliases, (uintptr_t)f.name, &absent);
+        if (absent != -1)
+            kh_value(aliases, a) = first;
+    }
+    last->ino = r->ino;
+    last->dev = r->dev;
+    if (group == NULL)
+        group = newfilelist();
+    pushfile(group, pushfiletab(&f));
+    return group;
+}
+
+#if SPILL_DIGEST_LEN != HASH_LEN
+#error "spilled records cannot hold signatures"
+#endif
+
+/**
+ * hash the first stage of the files of group, all of a size, and add them to
+ * splitspill along with their signatures; free group
+ */
+void splitgroup(struct filelist *group)
+{
+    size_t n = group->n;
+    struct candgroup g = { group, filetab[group->files[0]].size };
+    struct sigjob *sigjobs = malloc(n * sizeof *sigjobs);
+
+    for (size_t i = 0; i < n; ++i) {
+        sigjobs[i].file = &filetab[group->files[i]];
+        sigjobs[i].primary = NULL;
+    }
+    if (kh_size(aliases) > 0)
+        linkaliases(sigjobs, n);
+
+    startprogress("hashing first", stagesizes[0], n, countbytes(&g, 1, 0));
+    startpass(&stagestats[0], n, 1);
+    runsigjobs(sigjobs, n, 0);
+    endpass(&stagestats[0], n);
+    endprogress();
+
+    for (struct sigjob *job = sigjobs; job != sigjobs + n; ++job) {
+        if (job->primary) {
+            job->err = job->primary->err;
+            job->sig = job->primary->sig;
+        }
+        if (job->err)
             continue;
-        if (kl_next(kl_begin(dupes)) == kl_end(dupes)) { // size == 1?
-            if (flags & F_UNIQUE) {
-                fputs(kl_val(kl_begin(dupes)), stdout);
-                putverbatim(sep, seplen);
+        if (cache) {
+            struct cachekey key;
+            getcachekey(job->file, &key);
+            cache_put(cache, &key, hashedlen(job->sig.stage, job->sig.size),
+                      job->sig.digest);
+        }
+
+        const struct fileinfo *f = job->file;
+        struct spillrec r = { f->size, f->dev, f->ino, f->mtime, f->ctime,
+                              f->dir, 0, f->name };
+        memcpy(r.digest, job->sig.digest, sizeof r.digest);
+        if (spill_add(splitspill, 0, &r) == -1) {
+            errormsg("could not spill file records: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    free(sigjobs);
+    freefilelist(group);
+}
+
+/**
+ * take the records of splitspill in order and sort the files sharing their
+ * first signature into sets one group at a time, then free splitspill
+ *
+ * @param files an empty table to hold the sets of the group at hand
+ */
+void mergesplit(khash_t(sig) *files)
+{
+    struct filelist *group = NULL;      // of the signature of the last record
+    struct signature sig;
+    struct inodev last = { 0, 0 };
+    struct arena names;
+    struct spillrec r;
+    int ret;
+
+    arena_init(&names);
+    if (spill_merge(splitspill) == -1) {
+        errormsg("could not merge spilled file records: %s\n",
+                 strerror(errno));
+        exit(1);
+    }
+    do {
+        ret = spill_next(splitspill, &r);
+        if (ret == -1) {
+            errormsg("could not read spilled file records: %s\n",
+                     strerror(errno));
+            exit(1);
+        }
+
+        if (group && (ret == 0
+                || memcmp(r.digest, sig.digest, sizeof sig.digest) != 0)) {
+            // files hashed whole already, or alone, are done
+            if (group->n == 1 || sig.size <= stagesizes[0]) {
+                countset(group);
+                printdupes(group, &sig);
+                freefilelist(group);
+            } else {
+                struct candgroup *window = malloc(sizeof *window);
+                window->files = group;
+                window->size = sig.size;
+                streamwindow(window, 1, files, 1);
+            }
+            group = NULL;
+            kh_clear(alias, aliases);
+            nfiletab = 0;
+            arena_free(&names);
+        }
+        if (ret == 0)
+            break;
+
+        if (group == NULL) {
+            memcpy(sig.digest, r.digest, sizeof sig.digest);
+            sig.stage = 0;
+            sig.size = r.size;
+        }
+        group = pushspillrec(group, &r, &names, &last);
+    } while (ret == 1);
+    arena_free(&names);
+
+    struct spill *done = splitspill;
+    splitspill = NULL;
+    splitruns += spill_runs(done);
+    spill_free(done);
+}
+
+/**
+ * take the spilled records in order and sort them into sets a window of
+ * groups at a time, as streamfiles does, printing the files alone in their
+ * size as they come. Further paths to an inode are dropped or kept as
+ * aliases, as keepinode does, in path order rather than in the order found.
+ *
+ * The files of a size too many to hold within the memory limit are split:
+ * they are hashed a batch at a time, spilled again by signature, and sorted
+ * into sets a signature at a time by mergesplit.
+ *
+ * @param files an empty table to hold the sets of the groups at hand
+ */
+void spillfiles(khash_t(sig) *files)
+{
+    struct candgroup *groups = NULL;
+    size_t ngroups = 0, maxgroups = 0;
+    off_t bytes = 0;
+    struct filelist *group = NULL;      // of the size of the last record
+    off_t size = -1;                    // of the last record
+    size_t groupbytes = 0;              // taken by the records of group
+    struct inodev last = { 0, 0 };
+    struct arena names;                 // of the files in filetab
+    struct spillrec r;
+    int ret;
+
+    arena_init(&names);
+    if (spill_merge(spill) == -1) {
+        errormsg("could not merge spilled file records: %s\n",
+                 strerror(errno));
+        exit(1);
+    }
+    do {
+        ret = spill_next(spill, &r);
+        if (ret == -1) {
+            errormsg("could not read spilled file records: %s\n",
+                     strerror(errno));
+            exit(1);
+        }
+
+        if ((group || splitspill) && (ret == 0 || r.size != size)) {
+            if (splitspill) {
+                if (group)
+                    splitgroup(group);
+                mergesplit(files);
+            } else if (group->n == 1) {
+                printdupes(group, NULL);
+                freefilelist(group);
+            } else {
+                if (ngroups == maxgroups) {
+                    maxgroups = maxgroups ? 2 * maxgroups : 64;
+                    groups = realloc(groups, maxgroups * sizeof *groups);
+                }
+                groups[ngroups].files = group;
+                groups[ngroups++].size = filetab[group->files[0]].size;
+                bytes += filetab[group->files[0]].size * group->n;
             }
+            group = NULL;
+            groupbytes = 0;
+
+            // the files alone in their size count too, as filetab holds them
+            if (ret == 0 || nfiletab >= STREAM_FILES || bytes >= STREAM_BYTES) {
+                if (ngroups > 0)
+                    streamwindow(groups, ngroups, files, 0);
+                kh_clear(alias, aliases);
+                nfiletab = 0;
+                arena_free(&names);
+                groups = NULL;
+                ngroups = maxgroups = 0;
+                bytes = 0;
+            }
+        }
+        if (ret == 0)
+            break;
+
+        if (last.dev == r.dev && last.ino == r.ino
+                && !(flags & F_CONSIDERHARDLINKS) && !r.islink)
             continue;
-        } else {
-            if (flags & F_UNIQUE)
-                continue;
-            kliter_t(str) *p;
-            for (p = kl_begin(dupes); p != kl_end(dupes); p = kl_next(p)) {
-                if (flags & F_OMITFIRST && p == kl_begin(dupes))
-                    continue;
-                fputs(kl_val(p), stdout);
-                if (kl_next(p) != kl_end(dupes))
-                    putverbatim(sep, seplen);
+        group = pushspillrec(group, &r, &names, &last);
+        size = r.size;
+        groupbytes += sizeof(struct fileinfo) + strlen(r.name) + 1;
+        if (groupbytes < (size_t)memorylimit / 2)
+            continue;
+
+        // the size has more files than the limit holds: sort the window so
+        // far into sets, then spill the files of the size by signature
+        if (splitspill == NULL) {
+            if (ngroups > 0)
+                streamwindow(groups, ngroups, files, 0);
+            groups = NULL;
+            ngroups = maxgroups = 0;
+            bytes = 0;
+            splitspill = spill_init(1, memorylimit / 2, spillfds / 2,
+                                    cmpsplitrec);
+            if (splitspill == NULL) {
+                errormsg("could not make a directory for temporary files: "
+                         "%s\n", strerror(errno));
+                exit(1);
             }
-            putverbatim(setsep, setseplen);
         }
+        splitgroup(group);
+        group = NULL;
+        groupbytes = 0;
+        kh_clear(alias, aliases);
+        nfiletab = 0;
+        arena_free(&names);
+    } while (ret == 1);
+    arena_free(&names);
+}
+
+static void printpass(FILE *out, const char *name,
+    const struct passstats *pass, int first)
+{
+    fprintf(out, "%s\n    {\"name\":\"%s\",", first ? "" : ",", name);
+    if (pass >= stagestats && pass < stagestats + nstages)
+        fprintf(out, "\"length\":%lld,",
+                (long long)stagesizes[pass - stagestats]);
+    fprintf(out, "\"runs\":%zu,\"files_in\":%zu,\"files_out\":%zu,"
+            "\"groups\":%zu,\"bytes_read\":%llu,"
+            "\"files_opened\":%llu,\"errors\":%llu,"
+            "\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f}",
+            pass->runs, pass->filesin, pass->filesout, pass->groups,
+            pass->bytes, pass->opened, pass->errors, pass->wall, pass->cpu);
+}
+
+/**
+ * write the --stats report as a JSON object to statspath
+ */
+void printstats(void)
+{
+    int tostderr = strcmp(statspath, "-") == 0;
+    FILE *out = tostderr ? stderr : fopen(statspath, "w");
+    if (out == NULL) {
+        errormsg("could not write stats to %s: %s\n", statspath,
+                 strerror(errno));
+        return;
+    }
+
+    fputs("{\n  \"passes\":[", out);
+    printpass(out, "walk", &walkstats, 1);
+    for (size_t stage = 0; stage < nstages; ++stage)
+        if (stagestats[stage].runs > 0)
+            printpass(out, "prefix", &stagestats[stage], 0);
+    if (stagestats[SIG_FULL].runs > 0)
+        printpass(out, "full", &stagestats[SIG_FULL], 0);
+    if (stagestats[SIG_BYTES].runs > 0)
+        printpass(out, "bytes", &stagestats[SIG_BYTES], 0);
+    fprintf(out, "\n  ],\n  \"duplicate_sets\":%llu,"
+            "\"duplicate_files\":%llu,\"duplicate_bytes\":%llu,\"reclaimable_bytes\":%llu,"
+            "\"spilled_runs\":%zu}\n",
+            statssets, statsfiles, statsdupbytes, statsreclaim,
+            (spill ? spill_runs(spill) : 0) + splitruns);
+
+    if (!tostderr && fclose(out) == EOF)
+        errormsg("could not write stats to %s: %s\n", statspath,
+                 strerror(errno));
+}
+
+/**
+ * parse a size in bytes at the start of str, optionally followed by K, M or
+ * G, and set *end past it
+ *
+ * @return the size, or -1 if there is none or it is too large
+ */
+long long parsesize(const char *str, char **end)
+{
+    errno = 0;
+    long long size = strtoll(str, end, 10);
+    if (errno || *end == str || size < 0)
+        return -1;
+
+    int shift = 0;
+    switch (**end) {
+    case 'G': shift += 10; // fall through
+    case 'M': shift += 10; // fall through
+    case 'K': shift += 10; ++*end; break;
+    }
+    if (size > (LLONG_MAX >> shift))
+        return -1;
+    return size << shift;
+}
+
+/**
+ * parse an age as a number of days, or of seconds, minutes, hours, days or
+ * weeks if followed by s, m, h, d or w
+ *
+ * @return the age in seconds, or -1 if it is invalid
+ */
+long long parseage(const char *str)
+{
+    static const char units[] = "smhdw";
+    static const long long seconds[] = { 1, 60, 3600, 86400, 604800 };
+    char *end;
+
+    errno = 0;
+    long long age = strtoll(str, &end, 10);
+    if (errno || end == str || age < 0)
+        return -1;
+
+    long long unit = seconds[3];
+    if (*end && strchr(units, *end))
+        unit = seconds[strchr(units, *end++) - units];
+    if (*end || age > LLONG_MAX / unit)
+        return -1;
+    return age * unit;
+}
+
+void addglob(struct globlist *list, const char *glob)
+{
+    list->globs = realloc(list->globs, (list->n + 1) * sizeof *list->globs);
+    list->globs[list->n++] = glob;
+}
+
+/**
+ * set the prefix lengths of the signature stages from a comma separated list
+ * of increasing sizes in bytes, optionally followed by K, M or G, then
+ * continue the ladder growing by STAGE_GROWTH up to MAX_STAGES stages
+ *
+ * @return 0 on success, -1 if the list is invalid
+ */
+int parsestages(const char *arg)
+{
+    size_t n = 0;
+    const char *p = arg;
+
+    for (;;) {
+        char *end;
+        long long size = parsesize(p, &end);
+        if (size <= 0 || n == MAX_STAGES)
+            return -1;
+        if (n > 0 && size <= stagesizes[n - 1])
+            return -1;
+        stagesizes[n++] = size;
+
+        if (*end == '\0')
+            break;
+        if (*end != ',')
+            return -1;
+        p = end + 1;
+    }
+
+    nstages = n;
+    return 0;
+}
+
+/**
+ * continue the ladder of stages by STAGE_GROWTH while the stages are shorter
+ * than any likely file
+ */
+void growstages(void)
+{
+    while (nstages < MAX_STAGES
+            && stagesizes[nstages - 1] < (off_t)1 << 40) {
+        stagesizes[nstages] = stagesizes[nstages - 1] * STAGE_GROWTH;
+        ++nstages;
     }
 }
 
+enum {
+    OPT_IO = 256,
+    OPT_QUEUEDEPTH,
+    OPT_COMPARE,
+    OPT_HASH,
+    OPT_CACHE,
+    OPT_STAGES,
+    OPT_READORDER,
+    OPT_STREAM,
+    OPT_FORMAT,
+    OPT_STATS,
+    OPT_PAGECACHE,
+    OPT_SEGMENTSIZE,
+    OPT_MEMORYLIMIT,
+    OPT_DEVICEJOBS,
+    OPT_MINSIZE,
+    OPT_MAXSIZE,
+    OPT_INCLUDE,
+    OPT_EXCLUDE,
+    OPT_EXCLUDEDIR,
+    OPT_MAXDEPTH,
+    OPT_ONEFILESYSTEM,
+    OPT_MINAGE,
+    OPT_MAXAGE,
+};
+
 int parseopts(int argc, char **argv)
 {
     static struct option long_options[] = {
@@ -667,12 +3786,36 @@ int parseopts(int argc, char **argv)
         { "help",          0,                  NULL,  'h' },
         { "separator",     required_argument,  NULL,  'p' },
         { "setseparator",  required_argument,  NULL,  'P' },
+        { "jobs",          required_argument,  NULL,  'j' },
+        { "io",            required_argument,  NULL,  OPT_IO },
+        { "queue-depth",   required_argument,  NULL,  OPT_QUEUEDEPTH },
+        { "compare",       required_argument,  NULL,  OPT_COMPARE },
+        { "hash",          required_argument,  NULL,  OPT_HASH },
+        { "cache",         required_argument,  NULL,  OPT_CACHE },
+        { "stages",        required_argument,  NULL,  OPT_STAGES },
+        { "read-order",    required_argument,  NULL,  OPT_READORDER },
+        { "stream",        0,                  NULL,  OPT_STREAM },
+        { "format",        required_argument,  NULL,  OPT_FORMAT },
+        { "stats",         optional_argument,  NULL,  OPT_STATS },
+        { "page-cache",    required_argument,  NULL,  OPT_PAGECACHE },
+        { "segment-size",  required_argument,  NULL,  OPT_SEGMENTSIZE },
+        { "memory-limit",  required_argument,  NULL,  OPT_MEMORYLIMIT },
+        { "device-jobs",   required_argument,  NULL,  OPT_DEVICEJOBS },
+        { "min-size",      required_argument,  NULL,  OPT_MINSIZE },
+        { "max-size",      required_argument,  NULL,  OPT_MAXSIZE },
+        { "include",       required_argument,  NULL,  OPT_INCLUDE },
+        { "exclude",       required_argument,  NULL,  OPT_EXCLUDE },
+        { "exclude-dir",   required_argument,  NULL,  OPT_EXCLUDEDIR },
+        { "max-depth",     required_argument,  NULL,  OPT_MAXDEPTH },
+        { "one-file-system", 0,                NULL,  OPT_ONEFILESYSTEM },
+        { "min-age",       required_argument,  NULL,  OPT_MINAGE },
+        { "max-age",       required_argument,  NULL,  OPT_MAXAGE },
         { NULL,            0,                  NULL,  0 }
     };
 
     int opt;
 
-    while ((opt = getopt_long(argc, argv, "frqusHnvhp:P:",
+    while ((opt = getopt_long(argc, argv, "frqusHnvhp:P:j:",
                               long_options, NULL)) != EOF) {
         switch (opt) {
         case 'f':
@@ -728,6 +3871,197 @@ int parseopts(int argc, char **argv)
             flags |= F_SETSEPARATOR;
             break;
         }
+        case 'j': {
+            char *end;
+            errno = 0;
+            jobs = strtol(optarg, &end, 10);
+            if (errno || end == optarg || *end || jobs < 0) {
+                errormsg("invalid number of jobs: %s\n", optarg);
+                exit(1);
+            }
+            if (jobs == 0) {
+                jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                if (jobs < 1)
+                    jobs = 1;
+            }
+            break;
+        }
+        case OPT_MINSIZE:
+        case OPT_MAXSIZE: {
+            char *end;
+            off_t size = parsesize(optarg, &end);
+            if (size == -1 || *end) {
+                errormsg("invalid file size: %s\n", optarg);
+                exit(1);
+            }
+            if (opt == OPT_MINSIZE)
+                minfilesize = size;
+            else
+                maxfilesize = size;
+            break;
+        }
+        case OPT_INCLUDE:
+            addglob(&includes, optarg);
+            break;
+        case OPT_EXCLUDE:
+            addglob(&excludes, optarg);
+            break;
+        case OPT_EXCLUDEDIR:
+            addglob(&excludedirs, optarg);
+            break;
+        case OPT_MAXDEPTH: {
+            char *end;
+            errno = 0;
+            maxdepth = strtol(optarg, &end, 10);
+            if (errno || end == optarg || *end || maxdepth < 0) {
+                errormsg("invalid depth: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_ONEFILESYSTEM:
+            flags |= F_ONEFILESYSTEM;
+            break;
+        case OPT_MINAGE:
+        case OPT_MAXAGE: {
+            long long age = parseage(optarg);
+            if (age == -1) {
+                errormsg("invalid age: %s\n", optarg);
+                exit(1);
+            }
+            if (opt == OPT_MINAGE)
+                newest = time(NULL) - age;
+            else
+                oldest = time(NULL) - age;
+            break;
+        }
+        case OPT_DEVICEJOBS: {
+            char *end;
+            errno = 0;
+            rotationaljobs = strtol(optarg, &end, 10);
+            if (!errno && end != optarg && *end == ',') {
+                char *other = end + 1;
+                otherjobs = strtol(other, &end, 10);
+                if (end == other || otherjobs < 1)
+                    errno = EINVAL;
+            }
+            if (errno || end == optarg || *end || rotationaljobs < 1) {
+                errormsg("invalid number of device jobs: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_IO:
+            if (strcmp(optarg, "stdio") == 0)
+                io = IO_STDIO;
+            else if (strcmp(optarg, "uring") == 0)
+                io = IO_URING;
+            else {
+                errormsg("invalid io method: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_STREAM:
+            flags |= F_STREAM;
+            break;
+        case OPT_SEGMENTSIZE: {
+            char *end;
+            segmentsize = parsesize(optarg, &end);
+            // whole MiB, so that the size fits the engine name of the cache
+            if (segmentsize == -1 || *end || segmentsize % (1 << 20)
+                    || segmentsize > MAX_SEGMENT_SIZE) {
+                errormsg("invalid segment size: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_MEMORYLIMIT: {
+            char *end;
+            memorylimit = parsesize(optarg, &end);
+            if (memorylimit == -1 || *end || memorylimit < MIN_MEMORY_LIMIT) {
+                errormsg("invalid memory limit: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_PAGECACHE:
+            if (strcmp(optarg, "keep") == 0)
+                pagecache = PAGECACHE_KEEP;
+            else if (strcmp(optarg, "drop") == 0)
+                pagecache = PAGECACHE_DROP;
+            else if (strcmp(optarg, "direct") == 0)
+                pagecache = PAGECACHE_DIRECT;
+            else {
+                errormsg("invalid page cache policy: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_STATS:
+            statspath = optarg ? optarg : "-";
+            break;
+        case OPT_READORDER:
+            if (strcmp(optarg, "physical") == 0)
+                readorder = ORDER_PHYSICAL;
+            else if (strcmp(optarg, "inode") == 0)
+                readorder = ORDER_INODE;
+            else if (strcmp(optarg, "none") == 0)
+                readorder = ORDER_NONE;
+            else {
+                errormsg("invalid read order: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_STAGES:
+            if (parsestages(optarg) == -1) {
+                errormsg("invalid stages: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_CACHE:
+            cachepath = optarg;
+            break;
+        case OPT_HASH:
+            hash = findhashengine(optarg);
+            if (hash == NULL) {
+                errormsg("invalid hash engine: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_FORMAT:
+            if (strcmp(optarg, "text") == 0)
+                format = FORMAT_TEXT;
+            else if (strcmp(optarg, "json") == 0)
+                format = FORMAT_JSON;
+            else if (strcmp(optarg, "jsonl") == 0)
+                format = FORMAT_JSONL;
+            else if (strcmp(optarg, "nul") == 0)
+                format = FORMAT_NUL;
+            else {
+                errormsg("invalid output format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_COMPARE:
+            if (strcmp(optarg, "hash") == 0)
+                compare = COMPARE_HASH;
+            else if (strcmp(optarg, "bytes") == 0)
+                compare = COMPARE_BYTES;
+            else {
+                errormsg("invalid comparison method: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_QUEUEDEPTH: {
+            char *end;
+            errno = 0;
+            queuedepth = strtol(optarg, &end, 10);
+            if (errno || end == optarg || *end || queuedepth < 1
+                    || queuedepth > 4096) {
+                errormsg("invalid queue depth: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
 
         default:
             fprintf(stderr, "Try `finddupes --help' for more information.\n");
@@ -745,72 +4079,163 @@ int parseopts(int argc, char **argv)
 
 int main(int argc, char **argv)
 {
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
     int firstarg = parseopts(argc, argv);
     printd("-- %s firstarg %d flags 0x%x\n", __func__, firstarg, flags);
 
-    khash_t(str) *files = kh_init(str);
+    growstages();
+
+    if (cachepath) {
+        int err;
+        // signatures hashed as trees do not match those hashed whole
+        char engine[32];
+        if (segmentsize)
+            snprintf(engine, sizeof engine, "%s/%lldM", hash->name,
+                     (long long)(segmentsize >> 20));
+        else
+            snprintf(engine, sizeof engine, "%s", hash->name);
+        cache = cache_open(cachepath, engine, &err);
+        if (err)
+            errormsg("ignoring signature cache %s: %s\n", cachepath,
+                     strerror(err));
+    }
+
+    if (io == IO_URING) {
+        struct uring ring;
+        int err = uring_init(&ring, queuedepth);
+        if (err) {
+            errormsg("io_uring not available (%s), using stdio\n",
+                     strerror(-err));
+            io = IO_STDIO;
+        } else
+            uring_exit(&ring);
+    }
+
+    khash_t(size) *sizes = kh_init(size);
+    khash_t(sig) *files = kh_init(sig);
+    aliases = kh_init(alias);
+    struct candgroup *groups;
+    size_t ngroups;
 
     struct stat info;
-    // first pass: get file size signature
+    struct stat linfo;
+    // the PATH arguments, as if they were the entries of a directory
+    struct dirscan *top = newdirscan(NULL, NULL);
+    arenas = malloc(jobs * sizeof *arenas);
+    for (int i = 0; i < jobs; ++i)
+        arena_init(&arenas[i]);
+    if (memorylimit) {
+        // keep a quarter of the budget for the runs being merged, half of
+        // them for those of a size split by signature, see spillfiles
+        spillfds = fdbudget() / 4;
+        spillfds = spillfds < 4 ? 4
+            : spillfds > 2 * MAX_SPILL_FANIN ? 2 * MAX_SPILL_FANIN : spillfds;
+        spill = spill_init(jobs, memorylimit, spillfds / 2, cmpspillrec);
+        if (spill == NULL) {
+            errormsg("could not make a directory for temporary files: %s\n",
+                     strerror(errno));
+            exit(1);
+        }
+        atexit(removespill);
+        static const int sigs[] = { SIGHUP, SIGINT, SIGPIPE, SIGTERM,
+                                    SIGABRT, SIGBUS, SIGSEGV };
+        struct sigaction act = { .sa_handler = removespillonsignal,
+                                 .sa_flags = SA_RESETHAND };
+        sigemptyset(&act.sa_mask);
+        for (size_t i = 0; i < sizeof sigs / sizeof *sigs; ++i)
+            sigaction(sigs[i], &act, NULL);
+    }
+    // first pass: group files by size
+    startprogress("scanning files", 0, 0, 0);
+    startpass(&walkstats, 0, 0);
     for (int i = firstarg; i < argc; ++i) {
         if (stat(argv[i], &info) == -1) {
             errormsg("stat failed: %s: %s\n", argv[i], strerror(errno));
             continue;
         }
+        char *path = S_ISDIR(info.st_mode) ? normalizepath(argv[i])
+                                           : strdup(argv[i]);
+        if (lstat(path, &linfo) == -1) {
+            errormsg("lstat failed: %s: %s\n", path, strerror(errno));
+            free(path);
+            continue;
+        }
         if (S_ISDIR(info.st_mode)) {
-            char *dir = normalizepath(argv[i]);
-            grokdir(dir, files);
-            free(dir);
-        } else
-            grokfile(strdup(argv[i]), &info, files);
+            if (!S_ISLNK(linfo.st_mode) || flags & F_FOLLOWLINKS) {
+                struct pathdir *node = newpathdir(&arenas[0], NULL, path);
+                addwalkentry(top, NULL, NULL, 0, newdirscan(path, node));
+            } else
+                free(path);
+        } else {
+            if (acceptname(NULL, path)
+                    && acceptfile(path, &info, S_ISLNK(linfo.st_mode))) {
+                if (spill)
+                    spillfile(0, NULL, path, &info, S_ISLNK(linfo.st_mode));
+                else
+                    addwalkentry(top,
+                                 arena_strndup(&arenas[0], path, strlen(path)),
+                                 &info, S_ISLNK(linfo.st_mode), NULL);
+            }
+            free(path);
+        }
     }
+    walkdirs(top);
+    feeddir(top, sizes);
+    endpass(&walkstats, spill ? nspilled : nfiletab);
+    endprogress();
 
-    if (!(flags & F_HIDEPROGRESS))
-        fprintf(stderr, "\r%40s\r", " ");
-
-//    printd("-- after first pass: getfilesizesignature\n");
-//    dumpfiles(files);
+//    printd("-- after first pass: group by size\n");
+//    dumpfiles(sizes, files);
 
-    khash_t(str) *checked_files = kh_init(str);
-
-    // second pass: get partial signature (check the first bytes of the file)
-    for (khint_t k = kh_begin(files); k != kh_end(files); ++k)
-        if (kh_exist(files, k))
-            checkdupes(k, files, checked_files, getpartialsignature);
-    mergechecked(files, checked_files);
-
-//    printd("-- after second pass: getpartialsignature\n");
-//    dumpfiles(files);
-
-    // third pass: get full contents signature
-    for (khint_t k = kh_begin(files); k != kh_end(files); ++k)
-        if (kh_exist(files, k))
-            checkdupes(k, files, checked_files, getfullsignature);
-    mergechecked(files, checked_files);
-
-//    printd("-- after third pass: getfullsignature\n");
-//    dumpfiles(files);
-
-    if (!(flags & F_CONSIDERHARDLINKS))
-        for (khint_t k = kh_begin(files); k != kh_end(files); ++k)
-            if (kh_exist(files, k))
-                checkinodes(k, files);
-
-//    printd("-- after checkinodes\n");
-//    dumpfiles(files);
-
-    printfiles(files);
+    if (format == FORMAT_JSON)
+        putchar('[');
+    if (spill)
+        spillfiles(files);
+    else {
+        groups = takesizegroups(sizes, &ngroups);
+        if (flags & F_STREAM)
+            streamfiles(groups, ngroups, sizes, files);
+        else {
+            findsets(groups, ngroups, files, 0);
+            printfiles(sizes, files);
+        }
+    }
+    if (format == FORMAT_JSON)
+        puts("\n]");
+    if (statspath) {
+        fflush(stdout);
+        printstats();
+    }
 
-    freefiles(checked_files);
-    kh_destroy(str, checked_files);
+    freefiles(sizes, files);
+    kh_destroy(size, sizes);
+    kh_destroy(sig, files);
+    kh_destroy(alias, aliases);
+    free(filetab);
+    if (spill) {
+        struct spill *done = spill;
+        spill = NULL;
+        spill_free(done);
+    }
+    for (int i = 0; i < jobs; ++i)
+        arena_free(&arenas[i]);
+    free(arenas);
 
-    freefiles(files);
-    kh_destroy(str, files);
+    if (cache) {
+        if (cache_save(cache, cachepath) == -1)
+            errormsg("could not save signature cache %s: %s\n", cachepath,
+                     strerror(errno));
+        cache_free(cache);
+    }
 
     if (flags & F_SEPARATOR)
         free(sep);
     if (flags & F_SETSEPARATOR)
         free(setsep);
+    free(includes.globs);
+    free(excludes.globs);
+    free(excludedirs.globs);
 
     return 0;
 }
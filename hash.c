@@ -0,0 +1,75 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+
+#include <limits.h>
+#include <string.h>
+
+#include "hash.h"
+
+static void md5init(union hashstate *state)
+{
+    md5_init(&state->md5);
+}
+
+static void md5update(union hashstate *state, const void *data, size_t len)
+{
+    const md5_byte_t *p = data;
+
+    // md5_append takes an int length
+    while (len > INT_MAX) {
+        md5_append(&state->md5, p, INT_MAX);
+        p += INT_MAX;
+        len -= INT_MAX;
+    }
+    md5_append(&state->md5, p, len);
+}
+
+static void md5final(union hashstate *state, unsigned char digest[HASH_LEN])
+{
+    md5_finish(&state->md5, digest);
+}
+
+static void blake3init(union hashstate *state)
+{
+    blake3_init(&state->blake3);
+}
+
+static void blake3update(union hashstate *state, const void *data, size_t len)
+{
+    blake3_update(&state->blake3, data, len);
+}
+
+static void blake3final(union hashstate *state,
+    unsigned char digest[HASH_LEN])
+{
+    blake3_final(&state->blake3, digest, HASH_LEN);
+}
+
+static void xxh3init(union hashstate *state)
+{
+    xxh3_init(&state->xxh3);
+}
+
+static void xxh3update(union hashstate *state, const void *data, size_t len)
+{
+    xxh3_update(&state->xxh3, data, len);
+}
+
+static void xxh3final(union hashstate *state, unsigned char digest[HASH_LEN])
+{
+    xxh3_final(&state->xxh3, digest);
+}
+
+const struct hashengine hashengines[] = {
+    { "md5", md5init, md5update, md5final },
+    { "blake3", blake3init, blake3update, blake3final },
+    { "xxh3", xxh3init, xxh3update, xxh3final },
+    { NULL, NULL, NULL, NULL },
+};
+
+const struct hashengine *findhashengine(const char *name)
+{
+    for (const struct hashengine *e = hashengines; e->name; ++e)
+        if (strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
@@ -0,0 +1,38 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * Hash engines used to compute file signatures, selected by name.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+#include "blake3.h"
+#include "md5/md5.h"
+#include "xxh3.h"
+
+// length of the digests of every engine
+#define HASH_LEN 16
+
+union hashstate {
+    md5_state_t md5;
+    struct blake3 blake3;
+    struct xxh3 xxh3;
+};
+
+struct hashengine {
+    const char *name;
+    void (*init)(union hashstate *state);
+    void (*update)(union hashstate *state, const void *data, size_t len);
+    void (*final)(union hashstate *state, unsigned char digest[HASH_LEN]);
+};
+
+extern const struct hashengine hashengines[];
+
+/**
+ * @return the engine called name, or NULL if there is none
+ */
+const struct hashengine *findhashengine(const char *name);
+
+#endif
@@ -0,0 +1,440 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+
+// for qsort_r
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "spill.h"
+
+/*
+ * A run is a temporary file of records in order, each a struct runhead
+ * followed by the namelen bytes of its name. Runs are only ever read back by
+ * the process that wrote them, in host byte order. They are closed once
+ * written and named by number in a directory of their own, so that only the
+ * runs being merged take descriptors.
+ */
+struct runhead {
+    int64_t size;
+    uint64_t dev, ino;
+    int64_t mtime, ctime;
+    uintptr_t dir;
+    uint32_t namelen;
+    int32_t islink;
+    unsigned char digest[SPILL_DIGEST_LEN];
+};
+
+#define RUN_BUFFER_SIZE (64 * 1024)
+
+struct spillbuf {
+    struct spillrec *recs;
+    size_t n, max;
+    struct arena names;
+    size_t bytes;               // taken by the records and their names
+};
+
+/**
+ * where a merge takes records from: a run, or a buffer never spilled
+ */
+struct source {
+    FILE *run;                  // NULL for a buffer
+    struct spillbuf *buf;
+    size_t next;                // of the records of buf
+    struct spillrec rec;        // the current record
+    char *name;                 // of the current record of run
+    size_t maxname;
+};
+
+struct merge {
+    spillcmp cmp;
+    struct source *sources;
+    size_t nsources;
+    size_t *heap;               // indices of the sources with records left
+    size_t nheap;
+    int returned;               // the record at the top of heap was returned
+};
+
+struct spill {
+    spillcmp cmp;
+    struct spillbuf *bufs;
+    size_t nbufs;
+    size_t bufsize;             // bytes a buffer may take before it is spilled
+    size_t fanin;               // the most runs merged at once
+    char *dir;                  // of the runs
+    int dirfd;                  // open on dir, to remove the runs by
+    pthread_mutex_t lock;       // of runs, nextrun and written
+    size_t *runs;               // numbers of the runs left to merge, oldest first
+    size_t nruns, maxruns;
+    size_t nextrun;             // number of the next run
+    size_t written;             // runs written, merged ones included
+    struct merge merge;         // of the last runs and the buffers
+};
+
+static int cmprec(const void *a, const void *b, void *cmp)
+{
+    return (*(spillcmp *)cmp)(a, b);
+}
+
+struct spill *spill_init(size_t nbufs, size_t limit, size_t fanin,
+                         spillcmp order)
+{
+    const char *tmp = getenv("TMPDIR");
+    if (tmp == NULL || *tmp == '\0')
+        tmp = "/tmp";
+    char *dir = malloc(strlen(tmp) + sizeof "/finddupes.XXXXXX");
+    sprintf(dir, "%s/finddupes.XXXXXX", tmp);
+    if (mkdtemp(dir) == NULL) {
+        int err = errno;
+        free(dir);
+        errno = err;
+        return NULL;
+    }
+
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        int err = errno;
+        rmdir(dir);
+        free(dir);
+        errno = err;
+        return NULL;
+    }
+
+    struct spill *spill = calloc(1, sizeof *spill);
+
+    spill->cmp = order;
+    spill->dir = dir;
+    spill->dirfd = dirfd;
+    spill->nbufs = nbufs;
+    spill->bufsize = limit / nbufs;
+    spill->fanin = fanin < 2 ? 2 : fanin;
+    spill->bufs = calloc(nbufs, sizeof *spill->bufs);
+    for (size_t i = 0; i < nbufs; ++i)
+        arena_init(&spill->bufs[i].names);
+    pthread_mutex_init(&spill->lock, NULL);
+    return spill;
+}
+
+/**
+ * @return the path of the run numbered n, to be freed
+ */
+static char *runpath(const struct spill *spill, size_t n)
+{
+    char *path = malloc(strlen(spill->dir) + 24);
+    sprintf(path, "%s/%zu", spill->dir, n);
+    return path;
+}
+
+/**
+ * @return a new run to write to, with its number in n, or NULL with errno set
+ */
+static FILE *newrun(struct spill *spill, size_t *n)
+{
+    pthread_mutex_lock(&spill->lock);
+    *n = spill->nextrun++;
+    pthread_mutex_unlock(&spill->lock);
+
+    char *path = runpath(spill, *n);
+    FILE *run = fopen(path, "w");
+    free(path);
+    if (run)
+        setvbuf(run, NULL, _IOFBF, RUN_BUFFER_SIZE);
+    return run;
+}
+
+static void putrec(FILE *run, const struct spillrec *r)
+{
+    struct runhead head = { r->size, r->dev, r->ino, r->mtime, r->ctime,
+                            (uintptr_t)r->dir, strlen(r->name), r->islink };
+    memcpy(head.digest, r->digest, sizeof head.digest);
+    fwrite(&head, sizeof head, 1, run);
+    fwrite(r->name, 1, head.namelen, run);
+}
+
+/**
+ * close run, numbered n, and queue it to be merged
+ */
+static int endrun(struct spill *spill, FILE *run, size_t n)
+{
+    int failed = fflush(run) == EOF || ferror(run);
+    int err = errno;
+    if (fclose(run) == EOF && !failed) {
+        failed = 1;
+        err = errno;
+    }
+    if (failed) {
+        char *path = runpath(spill, n);
+        unlink(path);
+        free(path);
+        errno = err;
+        return -1;
+    }
+
+    pthread_mutex_lock(&spill->lock);
+    if (spill->nruns == spill->maxruns) {
+        spill->maxruns = spill->maxruns ? 2 * spill->maxruns : 16;
+        spill->runs = realloc(spill->runs,
+                              spill->maxruns * sizeof *spill->runs);
+    }
+    spill->runs[spill->nruns++] = n;
+    ++spill->written;
+    pthread_mutex_unlock(&spill->lock);
+    return 0;
+}
+
+/**
+ * write the records of b to a new run in order and empty b
+ */
+static int writerun(struct spill *spill, struct spillbuf *b)
+{
+    size_t n;
+    FILE *run = newrun(spill, &n);
+    if (run == NULL)
+        return -1;
+
+    qsort_r(b->recs, b->n, sizeof *b->recs, cmprec, &spill->cmp);
+    for (size_t i = 0; i < b->n; ++i)
+        putrec(run, &b->recs[i]);
+    if (endrun(spill, run, n) == -1)
+        return -1;
+
+    b->n = 0;
+    arena_free(&b->names);
+    arena_init(&b->names);
+    b->bytes = 0;
+    return 0;
+}
+
+int spill_add(struct spill *spill, size_t buf, const struct spillrec *r)
+{
+    struct spillbuf *b = &spill->bufs[buf];
+    size_t len = strlen(r->name);
+
+    if (b->n == b->max) {
+        b->max = b->max ? 2 * b->max : 64;
+        b->recs = realloc(b->recs, b->max * sizeof *b->recs);
+    }
+    b->recs[b->n] = *r;
+    b->recs[b->n++].name = arena_strndup(&b->names, r->name, len);
+    b->bytes += sizeof *b->recs + len + 1;
+
+    return b->bytes < spill->bufsize ? 0 : writerun(spill, b);
+}
+
+/**
+ * make the next record of s its current one
+ *
+ * @return 1 on success, 0 if there is none left, -1 on failure
+ */
+static int advance(struct source *s)
+{
+    if (s->run == NULL) {
+        if (s->next == s->buf->n)
+            return 0;
+        s->rec = s->buf->recs[s->next++];
+        return 1;
+    }
+
+    struct runhead head;
+    size_t got = fread(&head, 1, sizeof head, s->run);
+    if (got != sizeof head) {
+        if (got == 0 && !ferror(s->run))
+            return 0;
+        errno = ferror(s->run) ? errno : EIO;
+        return -1;
+    }
+    if (head.namelen + 1 > s->maxname) {
+        s->maxname = head.namelen + 1;
+        s->name = realloc(s->name, s->maxname);
+    }
+    if (fread(s->name, 1, head.namelen, s->run) != head.namelen) {
+        errno = ferror(s->run) ? errno : EIO;
+        return -1;
+    }
+    s->name[head.namelen] = '\0';
+
+    s->rec.size = head.size;
+    s->rec.dev = head.dev;
+    s->rec.ino = head.ino;
+    s->rec.mtime = head.mtime;
+    s->rec.ctime = head.ctime;
+    s->rec.dir = (const void *)head.dir;
+    s->rec.islink = head.islink;
+    memcpy(s->rec.digest, head.digest, sizeof s->rec.digest);
+    s->rec.name = s->name;
+    return 1;
+}
+
+static int heapless(const struct merge *m, size_t a, size_t b)
+{
+    return m->cmp(&m->sources[m->heap[a]].rec,
+                  &m->sources[m->heap[b]].rec) < 0;
+}
+
+static void siftdown(struct merge *m, size_t i)
+{
+    for (;;) {
+        size_t least = i, left = 2 * i + 1, right = left + 1;
+        if (left < m->nheap && heapless(m, left, least))
+            least = left;
+        if (right < m->nheap && heapless(m, right, least))
+            least = right;
+        if (least == i)
+            return;
+        size_t tmp = m->heap[i];
+        m->heap[i] = m->heap[least];
+        m->heap[least] = tmp;
+        i = least;
+    }
+}
+
+/**
+ * start merging the first nruns runs left, and the buffers as well if bufs,
+ * taking the runs off the ones left to merge; each is gone once m is ended
+ */
+static int startmerge(struct spill *spill, struct merge *m, size_t nruns,
+                      int bufs)
+{
+    m->cmp = spill->cmp;
+    m->nsources = nruns + (bufs ? spill->nbufs : 0);
+    m->sources = calloc(m->nsources, sizeof *m->sources);
+    m->heap = malloc(m->nsources * sizeof *m->heap);
+
+    for (size_t i = 0; i < nruns; ++i) {
+        char *path = runpath(spill, spill->runs[i]);
+        struct source *s = &m->sources[i];
+        s->run = fopen(path, "r");
+        if (s->run) {
+            unlink(path);
+            setvbuf(s->run, NULL, _IOFBF, RUN_BUFFER_SIZE);
+        }
+        free(path);
+        if (s->run == NULL)
+            return -1;
+    }
+    spill->nruns -= nruns;
+    memmove(spill->runs, spill->runs + nruns,
+            spill->nruns * sizeof *spill->runs);
+
+    for (size_t i = nruns; i < m->nsources; ++i) {
+        struct spillbuf *b = &spill->bufs[i - nruns];
+        qsort_r(b->recs, b->n, sizeof *b->recs, cmprec, &spill->cmp);
+        m->sources[i].buf = b;
+    }
+
+    for (size_t i = 0; i < m->nsources; ++i) {
+        int ret = advance(&m->sources[i]);
+        if (ret == -1)
+            return -1;
+        if (ret == 1)
+            m->heap[m->nheap++] = i;
+    }
+    for (size_t i = m->nheap / 2; i-- > 0; )
+        siftdown(m, i);
+    return 0;
+}
+
+static int nextrec(struct merge *m, struct spillrec *r)
+{
+    if (m->returned) {
+        // the source of the record returned last moves on to its next one
+        int ret = advance(&m->sources[m->heap[0]]);
+        if (ret == -1)
+            return -1;
+        if (ret == 0)
+            m->heap[0] = m->heap[--m->nheap];
+        siftdown(m, 0);
+    }
+
+    m->returned = m->nheap > 0;
+    if (!m->returned)
+        return 0;
+    *r = m->sources[m->heap[0]].rec;
+    return 1;
+}
+
+static void endmerge(struct merge *m)
+{
+    for (size_t i = 0; i < m->nsources; ++i) {
+        if (m->sources[i].run)
+            fclose(m->sources[i].run);
+        free(m->sources[i].name);
+    }
+    free(m->sources);
+    free(m->heap);
+    memset(m, 0, sizeof *m);
+}
+
+int spill_merge(struct spill *spill)
+{
+    // merge the oldest runs fanin at a time until the rest can be merged with
+    // the buffers at once
+    while (spill->nruns > spill->fanin) {
+        struct merge m = { NULL, NULL, 0, NULL, 0, 0 };
+        struct spillrec r;
+        size_t n;
+        FILE *run = NULL;
+        int ret = startmerge(spill, &m, spill->fanin, 0);
+        if (ret == 0)
+            ret = (run = newrun(spill, &n)) ? 1 : -1;
+        while (ret == 1)
+            if ((ret = nextrec(&m, &r)) == 1)
+                putrec(run, &r);
+        int err = errno;
+        endmerge(&m);
+        if (run && endrun(spill, run, n) == -1 && ret == 0)
+            return -1;
+        if (ret == -1) {
+            errno = err;
+            return -1;
+        }
+    }
+    return startmerge(spill, &spill->merge, spill->nruns, 1);
+}
+
+int spill_next(struct spill *spill, struct spillrec *r)
+{
+    return nextrec(&spill->merge, r);
+}
+
+size_t spill_runs(const struct spill *spill)
+{
+    return spill->written;
+}
+
+void spill_remove(const struct spill *spill)
+{
+    // runs are named by their number, and no longer exist once merged
+    for (size_t n = 0; n < spill->nextrun; ++n) {
+        char name[24], *p = name + sizeof name;
+        size_t i = n;
+        *--p = '\0';
+        do
+            *--p = '0' + i % 10;
+        while (i /= 10);
+        unlinkat(spill->dirfd, p, 0);
+    }
+    rmdir(spill->dir);
+}
+
+void spill_free(struct spill *spill)
+{
+    endmerge(&spill->merge);
+    spill_remove(spill);
+    close(spill->dirfd);
+    for (size_t i = 0; i < spill->nbufs; ++i) {
+        free(spill->bufs[i].recs);
+        arena_free(&spill->bufs[i].names);
+    }
+    pthread_mutex_destroy(&spill->lock);
+    free(spill->dir);
+    free(spill->runs);
+    free(spill->bufs);
+    free(spill);
+}
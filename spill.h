@@ -0,0 +1,80 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * Records of files kept within a memory limit. Each thread adds records to a
+ * buffer of its own, which is sorted and written to a temporary file as a run
+ * whenever it outgrows its share of the limit. The runs and what is left in
+ * the buffers are then merged back into a single stream of records in order,
+ * with at most a given number of runs open at a time.
+ */
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SPILL_DIGEST_LEN 16
+
+struct spillrec {
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime, ctime;
+    const void *dir;    // kept as is, only meaningful to this process
+    int islink;
+    const char *name;   // terminated by '\0'
+    unsigned char digest[SPILL_DIGEST_LEN];     // kept as is, for cmp
+};
+
+/**
+ * @return <0, 0 or >0 as a sorts before, with or after b
+ */
+typedef int (*spillcmp)(const struct spillrec *a, const struct spillrec *b);
+
+struct spill;
+
+/**
+ * @return an empty set of records ordered by cmp, spread over nbufs buffers
+ * of limit / nbufs bytes each, whose runs are merged fanin (2 or more) at a
+ * time, or NULL with errno set if there is no temporary directory for them
+ */
+struct spill *spill_init(size_t nbufs, size_t limit, size_t fanin,
+                         spillcmp cmp);
+
+/**
+ * add a copy of r to the buffer buf, which only one thread may use at a time,
+ * and spill the buffer to a run if it is full
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spill_add(struct spill *spill, size_t buf, const struct spillrec *r);
+
+/**
+ * start merging the runs and buffers, merging runs into fewer ones first
+ * while there are more than fanin; no records may be added any more
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spill_merge(struct spill *spill);
+
+/**
+ * @return 1 with the next record in order in r, valid until the next call, 0
+ * after the last one, or -1 on failure with errno set
+ */
+int spill_next(struct spill *spill, struct spillrec *r);
+
+/**
+ * @return the number of runs written to temporary files, merged ones included
+ */
+size_t spill_runs(const struct spill *spill);
+
+/**
+ * remove the runs left and their directory, as when exiting before the merge
+ * is done; only calls functions safe in a signal handler
+ */
+void spill_remove(const struct spill *spill);
+
+void spill_free(struct spill *spill);
+
+#endif
@@ -0,0 +1,197 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+
+#include <errno.h>
+#include <string.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(ring, 0, sizeof *ring);
+    memset(&p, 0, sizeof p);
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd == -1)
+        return -errno;
+
+    // IORING_OP_READ came along with this feature in Linux 5.6
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return -ENOSYS;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        err = -errno;
+        goto out_close;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            err = -errno;
+            goto out_unmap_sq;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        err = -errno;
+        goto out_unmap_cq;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+
+out_unmap_cq:
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+out_unmap_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+out_close:
+    close(ring->fd);
+    return err;
+}
+
+void uring_exit(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+int uring_read(struct uring *ring, int fd, void *buf, unsigned len,
+    off_t offset, void *data)
+{
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+        return -1;
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t)data;
+
+    ring->sq_array[index] = index;
+    store_release(ring->sq_tail, tail + 1);
+    ++ring->sq_pending;
+    return 0;
+}
+
+int uring_wait(struct uring *ring, void **data, int *res)
+{
+    for (;;) {
+        unsigned head = *ring->cq_head;
+
+        if (head != load_acquire(ring->cq_tail)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            *data = (void *)(uintptr_t)cqe->user_data;
+            *res = cqe->res;
+            store_release(ring->cq_head, head + 1);
+            return 0;
+        }
+
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        ring->sq_pending -= ret;
+    }
+}
+
+#else // !HAVE_IO_URING
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+    (void)ring;
+    (void)entries;
+    return -ENOSYS;
+}
+
+void uring_exit(struct uring *ring)
+{
+    (void)ring;
+}
+
+int uring_read(struct uring *ring, int fd, void *buf, unsigned len,
+    off_t offset, void *data)
+{
+    (void)ring;
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)offset;
+    (void)data;
+    return -1;
+}
+
+int uring_wait(struct uring *ring, void **data, int *res)
+{
+    (void)ring;
+    (void)data;
+    (void)res;
+    return -ENOSYS;
+}
+
+#endif
@@ -0,0 +1,53 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * Minimal io_uring interface for reading files asynchronously. It talks to
+ * the kernel through the raw system calls, so liburing is not required. On
+ * systems without io_uring uring_init() always fails with -ENOSYS.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_pending;        // queued but not yet submitted to the kernel
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/**
+ * set up ring with room for at least entries requests in flight
+ *
+ * @return 0 on success, -errno on failure
+ */
+int uring_init(struct uring *ring, unsigned entries);
+
+void uring_exit(struct uring *ring);
+
+/**
+ * queue a read of len bytes at offset from fd into buf; data is handed back
+ * by uring_wait() once the read completes
+ *
+ * @return 0 on success, -1 if the submission queue is full
+ */
+int uring_read(struct uring *ring, int fd, void *buf, unsigned len,
+    off_t offset, void *data);
+
+/**
+ * submit the queued requests and wait for the completion of any request
+ *
+ * @param data set to the data passed when queueing the completed request
+ * @param res set to the result of the request: the number of bytes read, or
+ *        -errno
+ * @return 0 on success, -errno on failure
+ */
+int uring_wait(struct uring *ring, void **data, int *res);
+
+#endif
@@ -8,6 +8,7 @@
 void *__real_malloc (size_t size);
 void *__real_calloc(size_t nmemb, size_t size);
 void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
 
 void *
 __wrap_malloc (size_t size)
@@ -45,3 +46,13 @@ void *__wrap_realloc(void *ptr, size_t size)
     }
     return ret;
 }
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    int ret = __real_posix_memalign(memptr, alignment, size);
+    if (size && ret) {
+        fputs("Out of memory!\n", stderr);
+        abort();
+    }
+    return ret;
+}
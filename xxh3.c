@@ -0,0 +1,405 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+
+#include <string.h>
+
+#include "xxh3.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define STRIPE_LEN 64
+#define SECRET_LEN 192
+#define STRIPES_PER_BLOCK ((SECRET_LEN - STRIPE_LEN) / 8)
+#define MIDSIZE_MAX 240
+
+static const uint32_t PRIME32_1 = 0x9E3779B1U;
+static const uint32_t PRIME32_2 = 0x85EBCA77U;
+static const uint32_t PRIME32_3 = 0xC2B2AE3DU;
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static const uint64_t PRIME_MX1 = 0x165667919E3779F9ULL;
+static const uint64_t PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+// the default secret, which every input is keyed with
+static const uint8_t SECRET[SECRET_LEN] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+    0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+    0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+    0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+    0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+    0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+    0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+    0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+    0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+struct u128 {
+    uint64_t low;
+    uint64_t high;
+};
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+        | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+    return (uint64_t)load32(p) | (uint64_t)load32(p + 4) << 32;
+}
+
+static inline void store64be(uint8_t *p, uint64_t w)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = w >> 8 * (7 - i);
+}
+
+static inline uint32_t rotl32(uint32_t w, int c)
+{
+    return (w << c) | (w >> (32 - c));
+}
+
+static inline uint32_t swap32(uint32_t w)
+{
+    return (w << 24) | (w << 8 & 0xff0000) | (w >> 8 & 0xff00) | (w >> 24);
+}
+
+static inline uint64_t swap64(uint64_t w)
+{
+    return (uint64_t)swap32(w) << 32 | swap32(w >> 32);
+}
+
+static inline struct u128 mul64to128(uint64_t a, uint64_t b)
+{
+    struct u128 r;
+#ifdef __SIZEOF_INT128__
+    __extension__ unsigned __int128 p = (unsigned __int128)a * b;
+    r.low = p;
+    r.high = p >> 64;
+#else
+    uint64_t lolo = (a & 0xffffffff) * (b & 0xffffffff);
+    uint64_t hilo = (a >> 32) * (b & 0xffffffff);
+    uint64_t lohi = (a & 0xffffffff) * (b >> 32);
+    uint64_t hihi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lolo >> 32) + (hilo & 0xffffffff) + lohi;
+    r.high = (hilo >> 32) + (cross >> 32) + hihi;
+    r.low = (cross << 32) | (lolo & 0xffffffff);
+#endif
+    return r;
+}
+
+static inline uint64_t mulfold64(uint64_t a, uint64_t b)
+{
+    struct u128 p = mul64to128(a, b);
+    return p.low ^ p.high;
+}
+
+static uint64_t avalanche64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t mix16(const uint8_t *input, const uint8_t *secret,
+    uint64_t seed)
+{
+    return mulfold64(load64(input) ^ (load64(secret) + seed),
+        load64(input + 8) ^ (load64(secret + 8) - seed));
+}
+
+static inline void mix32(struct u128 *acc, const uint8_t *in1,
+    const uint8_t *in2, const uint8_t *secret, uint64_t seed)
+{
+    acc->low += mix16(in1, secret, seed);
+    acc->low ^= load64(in2) + load64(in2 + 8);
+    acc->high += mix16(in2, secret + 16, seed);
+    acc->high ^= load64(in1) + load64(in1 + 8);
+}
+
+static struct u128 hash0to3(const uint8_t *input, size_t len)
+{
+    struct u128 h;
+
+    if (len == 0) {
+        h.low = avalanche64(load64(SECRET + 64) ^ load64(SECRET + 72));
+        h.high = avalanche64(load64(SECRET + 80) ^ load64(SECRET + 88));
+        return h;
+    }
+
+    uint32_t combinedl = (uint32_t)input[0] << 16
+        | (uint32_t)input[len >> 1] << 24 | input[len - 1] | len << 8;
+    uint32_t combinedh = rotl32(swap32(combinedl), 13);
+    h.low = avalanche64(combinedl ^ (load32(SECRET) ^ load32(SECRET + 4)));
+    h.high = avalanche64(combinedh
+        ^ (load32(SECRET + 8) ^ load32(SECRET + 12)));
+    return h;
+}
+
+static struct u128 hash4to8(const uint8_t *input, size_t len)
+{
+    uint64_t in64 = load32(input) + ((uint64_t)load32(input + len - 4) << 32);
+    uint64_t keyed = in64 ^ (load64(SECRET + 16) ^ load64(SECRET + 24));
+    struct u128 m = mul64to128(keyed, PRIME64_1 + (len << 2));
+
+    m.high += m.low << 1;
+    m.low ^= m.high >> 3;
+    m.low ^= m.low >> 35;
+    m.low *= PRIME_MX2;
+    m.low ^= m.low >> 28;
+    m.high = avalanche(m.high);
+    return m;
+}
+
+static struct u128 hash9to16(const uint8_t *input, size_t len)
+{
+    uint64_t bitflipl = load64(SECRET + 32) ^ load64(SECRET + 40);
+    uint64_t bitfliph = load64(SECRET + 48) ^ load64(SECRET + 56);
+    uint64_t inlow = load64(input);
+    uint64_t inhigh = load64(input + len - 8);
+    struct u128 m = mul64to128(inlow ^ inhigh ^ bitflipl, PRIME64_1);
+
+    m.low += (uint64_t)(len - 1) << 54;
+    inhigh ^= bitfliph;
+    m.high += inhigh + (uint64_t)(uint32_t)inhigh * (PRIME32_2 - 1);
+    m.low ^= swap64(m.high);
+
+    struct u128 h = mul64to128(m.low, PRIME64_2);
+    h.high += m.high * PRIME64_2;
+    h.low = avalanche(h.low);
+    h.high = avalanche(h.high);
+    return h;
+}
+
+static struct u128 finishmid(struct u128 acc, size_t len)
+{
+    struct u128 h;
+
+    h.low = avalanche(acc.low + acc.high);
+    h.high = 0 - avalanche(acc.low * PRIME64_1 + acc.high * PRIME64_4
+        + len * PRIME64_2);
+    return h;
+}
+
+static struct u128 hash17to128(const uint8_t *input, size_t len)
+{
+    struct u128 acc = { len * PRIME64_1, 0 };
+
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96)
+                mix32(&acc, input + 48, input + len - 64, SECRET + 96, 0);
+            mix32(&acc, input + 32, input + len - 48, SECRET + 64, 0);
+        }
+        mix32(&acc, input + 16, input + len - 32, SECRET + 32, 0);
+    }
+    mix32(&acc, input, input + len - 16, SECRET, 0);
+    return finishmid(acc, len);
+}
+
+static struct u128 hash129to240(const uint8_t *input, size_t len)
+{
+    struct u128 acc = { len * PRIME64_1, 0 };
+    size_t rounds = len / 32;
+
+    for (size_t i = 0; i < 4; ++i)
+        mix32(&acc, input + 32 * i, input + 32 * i + 16, SECRET + 32 * i, 0);
+    acc.low = avalanche(acc.low);
+    acc.high = avalanche(acc.high);
+    for (size_t i = 4; i < rounds; ++i)
+        mix32(&acc, input + 32 * i, input + 32 * i + 16,
+            SECRET + 3 + 32 * (i - 4), 0);
+    mix32(&acc, input + len - 16, input + len - 32, SECRET + 136 - 17 - 16, 0);
+    return finishmid(acc, len);
+}
+
+static struct u128 hashshort(const uint8_t *input, size_t len)
+{
+    if (len <= 3)
+        return hash0to3(input, len);
+    if (len <= 8)
+        return hash4to8(input, len);
+    if (len <= 16)
+        return hash9to16(input, len);
+    if (len <= 128)
+        return hash17to128(input, len);
+    return hash129to240(input, len);
+}
+
+static inline void accumulate512(uint64_t acc[8], const uint8_t *input,
+    const uint8_t *secret)
+{
+#ifdef HAVE_SSE2
+    __m128i *a = (__m128i*)acc;     // not aligned to 16 bytes
+    for (int i = 0; i < 4; ++i) {
+        __m128i data = _mm_loadu_si128((const __m128i*)input + i);
+        __m128i key = _mm_xor_si128(data,
+            _mm_loadu_si128((const __m128i*)secret + i));
+        __m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key,
+            _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        _mm_storeu_si128(a + i, _mm_add_epi64(_mm_loadu_si128(a + i),
+            _mm_add_epi64(product, swapped)));
+    }
+#else
+    for (int i = 0; i < 8; ++i) {
+        uint64_t data = load64(input + 8 * i);
+        uint64_t key = data ^ load64(secret + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (uint64_t)(uint32_t)key * (key >> 32);
+    }
+#endif
+}
+
+static void scramble(uint64_t acc[8], const uint8_t *secret)
+{
+    for (int i = 0; i < 8; ++i) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= load64(secret + 8 * i);
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+/**
+ * accumulate n stripes of input, scrambling the accumulators whenever a
+ * block of STRIPES_PER_BLOCK stripes is full
+ */
+static void consumestripes(uint64_t acc[8], size_t *stripes,
+    const uint8_t *input, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        accumulate512(acc, input + i * STRIPE_LEN, SECRET + *stripes * 8);
+        if (++*stripes == STRIPES_PER_BLOCK) {
+            scramble(acc, SECRET + SECRET_LEN - STRIPE_LEN);
+            *stripes = 0;
+        }
+    }
+}
+
+static uint64_t mergeaccs(const uint64_t acc[8], const uint8_t *secret,
+    uint64_t start)
+{
+    uint64_t result = start;
+    for (int i = 0; i < 4; ++i)
+        result += mulfold64(acc[2 * i] ^ load64(secret + 16 * i),
+            acc[2 * i + 1] ^ load64(secret + 16 * i + 8));
+    return avalanche(result);
+}
+
+void xxh3_init(struct xxh3 *self)
+{
+    static const uint64_t init[8] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+    };
+
+    memcpy(self->acc, init, sizeof(init));
+    self->buffered = 0;
+    self->stripes = 0;
+    self->total = 0;
+}
+
+void xxh3_update(struct xxh3 *self, const void *data, size_t len)
+{
+    const uint8_t *input = data;
+
+    self->total += len;
+    if (self->buffered + len <= XXH3_BUFFER_LEN) {
+        memcpy(self->buffer + self->buffered, input, len);
+        self->buffered += len;
+        return;
+    }
+
+    // the last stripe is keyed differently, so at least one byte is always
+    // left buffered for xxh3_final
+    if (self->buffered > 0) {
+        size_t take = XXH3_BUFFER_LEN - self->buffered;
+        memcpy(self->buffer + self->buffered, input, take);
+        input += take;
+        len -= take;
+        consumestripes(self->acc, &self->stripes, self->buffer,
+            XXH3_BUFFER_LEN / STRIPE_LEN);
+        self->buffered = 0;
+    }
+
+    if (len > XXH3_BUFFER_LEN) {
+        size_t n = (len - 1) / STRIPE_LEN;
+        consumestripes(self->acc, &self->stripes, input, n);
+        input += n * STRIPE_LEN;
+        len -= n * STRIPE_LEN;
+        // kept for xxh3_final, should fewer than STRIPE_LEN bytes follow
+        memcpy(self->buffer + XXH3_BUFFER_LEN - STRIPE_LEN,
+            input - STRIPE_LEN, STRIPE_LEN);
+    }
+
+    memcpy(self->buffer, input, len);
+    self->buffered = len;
+}
+
+void xxh3_final(const struct xxh3 *self, uint8_t out[XXH3_OUT_LEN])
+{
+    struct u128 h;
+
+    if (self->total <= MIDSIZE_MAX) {
+        h = hashshort(self->buffer, self->total);
+    } else {
+        uint64_t acc[8];
+        size_t stripes = self->stripes;
+        uint8_t last[STRIPE_LEN];
+        const uint8_t *p;
+
+        memcpy(acc, self->acc, sizeof(acc));
+        if (self->buffered >= STRIPE_LEN) {
+            consumestripes(acc, &stripes, self->buffer,
+                (self->buffered - 1) / STRIPE_LEN);
+            p = self->buffer + self->buffered - STRIPE_LEN;
+        } else {
+            size_t catchup = STRIPE_LEN - self->buffered;
+            memcpy(last, self->buffer + XXH3_BUFFER_LEN - catchup, catchup);
+            memcpy(last + catchup, self->buffer, self->buffered);
+            p = last;
+        }
+        accumulate512(acc, p, SECRET + SECRET_LEN - STRIPE_LEN - 7);
+        h.low = mergeaccs(acc, SECRET + 11, self->total * PRIME64_1);
+        h.high = mergeaccs(acc, SECRET + SECRET_LEN - STRIPE_LEN - 11,
+            ~(self->total * PRIME64_2));
+    }
+
+    store64be(out, h.high);
+    store64be(out + 8, h.low);
+}
@@ -0,0 +1,33 @@
+// vim: tabstop=8 expandtab shiftwidth=4 softtabstop=4
+/*
+ * XXH3 hashing of 128 bits, without seed or custom secret. It is no
+ * cryptographic hash, but much faster than MD5 for telling files apart.
+ */
+
+#ifndef XXH3_H
+#define XXH3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XXH3_OUT_LEN 16
+#define XXH3_BUFFER_LEN 256
+
+struct xxh3 {
+    uint64_t acc[8];
+    uint8_t buffer[XXH3_BUFFER_LEN];
+    size_t buffered;
+    size_t stripes;             // in the current block
+    uint64_t total;
+};
+
+void xxh3_init(struct xxh3 *self);
+void xxh3_update(struct xxh3 *self, const void *input, size_t len);
+
+/**
+ * write the hash to out in canonical order, the high 64 bits first, both big
+ * endian
+ */
+void xxh3_final(const struct xxh3 *self, uint8_t out[XXH3_OUT_LEN]);
+
+#endif